@@ -0,0 +1,377 @@
+/*  Microbenchmark of the math and culling functions of the framework.
+	Times every function over large batches of random data (always the same seed) and prints ns/op,
+	then checks the results against straightforward double precision implementations.
+	It only needs framework.cpp and camera.cpp built with SKIP_GL and SKIP_IMGUI (no SDL or OpenGL):
+
+		g++ -O2 -std=c++14 -DSKIP_GL -DSKIP_IMGUI -I../src math_benchmark.cpp ../src/framework.cpp ../src/camera.cpp -o math_benchmark
+		cl /O2 /EHsc /DSKIP_GL /DSKIP_IMGUI /I..\src math_benchmark.cpp ..\src\framework.cpp ..\src\camera.cpp
+
+	Add -DFRAMEWORK_NO_SIMD (/DFRAMEWORK_NO_SIMD) for the scalar baseline, or -mavx2 -mfma (/arch:AVX2) for the AVX version.
+
+	Usage: math_benchmark [batch size] [repetitions]
+	Returns 1 if any result is further from the reference than the tolerance.
+*/
+
+#include "framework.h"
+#include "camera.h"
+
+#include <chrono>
+#include <random>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+
+static std::mt19937 rng(1234);
+
+//not std::uniform_real_distribution, its output is not the same in every standard library
+static float random(float min, float max)
+{
+	return min + (max - min) * (rng() / (float)rng.max());
+}
+
+static Vector3 randomVector(float range)
+{
+	return Vector3(random(-range, range), random(-range, range), random(-range, range));
+}
+
+static Quaternion randomQuaternion()
+{
+	Vector3 axis = randomVector(1.0f);
+	if (axis.length() < 0.001f)
+		axis.set(0, 1, 0);
+	axis.normalize();
+	return Quaternion(axis, random(0.0f, 2.0f * (float)PI));
+}
+
+//translation, rotation and scale, like the models of the nodes
+static Matrix44 randomModel()
+{
+	Matrix44 m;
+	m.setTranslation(random(-1000.0f, 1000.0f), random(-1000.0f, 1000.0f), random(-1000.0f, 1000.0f));
+	Vector3 axis = randomVector(1.0f);
+	if (axis.length() < 0.001f)
+		axis.set(1, 0, 0);
+	axis.normalize();
+	m.rotate(random(0.0f, 2.0f * (float)PI), axis);
+	m.scale(random(0.1f, 10.0f), random(0.1f, 10.0f), random(0.1f, 10.0f));
+	return m;
+}
+
+//keeps the results alive so the compiler cannot remove the work
+static volatile float sink = 0.0f;
+
+//best of the repetitions, in ns per operation
+template<typename F>
+static double timeBatch(int ops, int repetitions, F function)
+{
+	double best = 1e30;
+	for (int r = 0; r < repetitions; ++r)
+	{
+		auto start = std::chrono::steady_clock::now();
+		function();
+		auto end = std::chrono::steady_clock::now();
+		double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / (double)ops;
+		best = std::min(best, ns);
+	}
+	return best;
+}
+
+static int failures = 0;
+
+static void report(const char* name, double ns, double error, double tolerance)
+{
+	bool ok = error <= tolerance;
+	if (!ok)
+		failures++;
+	printf("%-28s %10.2f ns/op   max error %.3g %s\n", name, ns, error, ok ? "" : "(FAILED)");
+}
+
+//references in double *********************
+
+//also the sum of the absolute values of the terms, the errors are relative to it as the terms can cancel out
+static void referenceMultiply(const Matrix44& a, const Matrix44& b, double* out, double* magnitude)
+{
+	for (int i = 0; i < 4; ++i)
+		for (int j = 0; j < 4; ++j)
+		{
+			double sum = 0.0, abs_sum = 0.0;
+			for (int k = 0; k < 4; ++k)
+			{
+				sum += (double)a.M[i][k] * b.M[k][j];
+				abs_sum += fabs((double)a.M[i][k] * b.M[k][j]);
+			}
+			out[i * 4 + j] = sum;
+			magnitude[i * 4 + j] = std::max(abs_sum, 1e-30);
+		}
+}
+
+//error of a * b against the identity, the entries that should be 0 can have tiny terms so it is never relative to less than 1
+static double identityError(const Matrix44& a, const Matrix44& b)
+{
+	double product[16], magnitude[16];
+	referenceMultiply(a, b, product, magnitude);
+	double error = 0.0;
+	for (int i = 0; i < 16; ++i)
+		error = std::max(error, fabs(product[i] - (i % 5 == 0 ? 1.0 : 0.0)) / std::max(magnitude[i], 1.0));
+	return error;
+}
+
+//exact bounds of the transformed box (Arvo): the new halfsize is the absolute value of the matrix times the old one
+static void referenceTransformBox(const Matrix44& m, const BoundingBox& box, double* center, double* halfsize)
+{
+	const double c[3] = { box.center.x, box.center.y, box.center.z };
+	const double h[3] = { box.halfsize.x, box.halfsize.y, box.halfsize.z };
+	for (int i = 0; i < 3; ++i)
+	{
+		center[i] = m.m[12 + i];
+		halfsize[i] = 0.0;
+		for (int j = 0; j < 3; ++j)
+		{
+			center[i] += (double)m.m[j * 4 + i] * c[j];
+			halfsize[i] += fabs((double)m.m[j * 4 + i]) * h[j];
+		}
+	}
+}
+
+static void referenceSlerp(const Quaternion& a, const Quaternion& b, double t, double* out)
+{
+	double qa[4] = { a.x, a.y, a.z, a.w };
+	double qb[4] = { b.x, b.y, b.z, b.w };
+	double dot = qa[0] * qb[0] + qa[1] * qb[1] + qa[2] * qb[2] + qa[3] * qb[3];
+	if (dot < 0.0)
+	{
+		dot = -dot;
+		for (int i = 0; i < 4; ++i)
+			qb[i] = -qb[i];
+	}
+	double wa = 1.0 - t, wb = t;
+	if (dot < 0.9999)
+	{
+		double angle = acos(dot);
+		wa = sin(angle * (1.0 - t)) / sin(angle);
+		wb = sin(angle * t) / sin(angle);
+	}
+	double length = 0.0;
+	for (int i = 0; i < 4; ++i)
+	{
+		out[i] = qa[i] * wa + qb[i] * wb;
+		length += out[i] * out[i];
+	}
+	for (int i = 0; i < 4; ++i)
+		out[i] /= sqrt(length);
+}
+
+//v + 2w(q x v) + 2 q x (q x v)
+static void referenceRotate(const Quaternion& q, const double* v, double* out)
+{
+	double qv[3] = { q.x, q.y, q.z };
+	double t[3] = { 2.0 * (qv[1] * v[2] - qv[2] * v[1]), 2.0 * (qv[2] * v[0] - qv[0] * v[2]), 2.0 * (qv[0] * v[1] - qv[1] * v[0]) };
+	out[0] = v[0] + q.w * t[0] + (qv[1] * t[2] - qv[2] * t[1]);
+	out[1] = v[1] + q.w * t[1] + (qv[2] * t[0] - qv[0] * t[2]);
+	out[2] = v[2] + q.w * t[2] + (qv[0] * t[1] - qv[1] * t[0]);
+}
+
+//outside if the 8 corners are outside the same clip plane, returns the distance of the box to the border of that
+//plane (negative inside) so the cases too close to decide with floats can be skipped
+static bool referenceBoxOutside(const Matrix44& viewprojection, const BoundingBox& box, double& margin)
+{
+	double corners[8][4];
+	for (int c = 0; c < 8; ++c)
+	{
+		double p[3] = { box.center.x + ((c & 1) ? 1 : -1) * box.halfsize.x, box.center.y + ((c & 2) ? 1 : -1) * box.halfsize.y, box.center.z + ((c & 4) ? 1 : -1) * box.halfsize.z };
+		for (int i = 0; i < 4; ++i)
+			corners[c][i] = viewprojection.m[i] * p[0] + viewprojection.m[4 + i] * p[1] + viewprojection.m[8 + i] * p[2] + viewprojection.m[12 + i];
+	}
+	margin = 1e30;
+	bool outside = false;
+	for (int plane = 0; plane < 6; ++plane)
+	{
+		int axis = plane / 2;
+		double sign = (plane % 2) ? -1.0 : 1.0;
+		double max_distance = -1e30;	//of the corner more inside, w - x for the right plane, w + x for the left...
+		for (int c = 0; c < 8; ++c)
+			max_distance = std::max(max_distance, (corners[c][3] - sign * corners[c][axis]) / fabs(corners[c][3] + 1e-6));
+		margin = std::min(margin, fabs(max_distance));
+		if (max_distance < 0.0)
+			outside = true;
+	}
+	return outside;
+}
+
+int main(int argc, char** argv)
+{
+	int n = argc > 1 ? atoi(argv[1]) : (1 << 16);
+	int repetitions = argc > 2 ? atoi(argv[2]) : 10;
+#if defined(FRAMEWORK_AVX)
+	const char* simd = "AVX";
+#elif defined(FRAMEWORK_SSE)
+	const char* simd = "SSE";
+#else
+	const char* simd = "scalar";
+#endif
+	printf("%s, batch of %d, best of %d repetitions\n\n", simd, n, repetitions);
+
+	std::vector<Matrix44> a(n), b(n), results(n);
+	std::vector<BoundingBox> boxes(n), boxes_result(n);
+	std::vector<Quaternion> qa(n), qb(n), q_result(n);
+	std::vector<float> ts(n);
+	std::vector<char> clip(n);
+	for (int i = 0; i < n; ++i)
+	{
+		a[i] = randomModel();
+		b[i] = randomModel();
+		boxes[i] = BoundingBox(randomVector(2000.0f), Vector3(random(1.0f, 100.0f), random(1.0f, 100.0f), random(1.0f, 100.0f)));
+		qa[i] = randomQuaternion();
+		qb[i] = randomQuaternion();
+		ts[i] = random(0.0f, 1.0f);
+	}
+
+	//Matrix44::operator*
+	double ns = timeBatch(n, repetitions, [&]() {
+		for (int i = 0; i < n; ++i)
+			results[i] = a[i] * b[i];
+		sink = sink + results[n - 1].m[0];
+	});
+	double error = 0.0;
+	for (int i = 0; i < n; ++i)
+	{
+		double product[16], magnitude[16];
+		referenceMultiply(a[i], b[i], product, magnitude);
+		for (int j = 0; j < 16; ++j)
+			error = std::max(error, fabs(product[j] - results[i].m[j]) / magnitude[j]);
+	}
+	report("Matrix44::operator*", ns, error, 1e-5);
+
+	//Matrix44::inverse, the error is the distance of M * M^-1 to the identity
+	ns = timeBatch(n, repetitions, [&]() {
+		for (int i = 0; i < n; ++i)
+		{
+			results[i] = a[i];
+			results[i].inverse();
+		}
+		sink = sink + results[n - 1].m[0];
+	});
+	error = 0.0;
+	for (int i = 0; i < n; ++i)
+		error = std::max(error, identityError(a[i], results[i]));
+	report("Matrix44::inverse", ns, error, 1e-3);
+
+	//Matrix44 * Vector3
+	std::vector<Vector3> points(n), points_result(n);
+	for (int i = 0; i < n; ++i)
+		points[i] = randomVector(1000.0f);
+	ns = timeBatch(n, repetitions, [&]() {
+		for (int i = 0; i < n; ++i)
+			points_result[i] = a[i] * points[i];
+		sink = sink + points_result[n - 1].x;
+	});
+	error = 0.0;
+	for (int i = 0; i < n; ++i)
+		for (int j = 0; j < 3; ++j)
+		{
+			double value = a[i].m[12 + j] + (double)a[i].m[j] * points[i].x + (double)a[i].m[4 + j] * points[i].y + (double)a[i].m[8 + j] * points[i].z;
+			double magnitude = fabs(a[i].m[12 + j]) + fabs((double)a[i].m[j] * points[i].x) + fabs((double)a[i].m[4 + j] * points[i].y) + fabs((double)a[i].m[8 + j] * points[i].z);
+			error = std::max(error, fabs(value - points_result[i].v[j]) / std::max(magnitude, 1e-30));
+		}
+	report("Matrix44 * Vector3", ns, error, 1e-5);
+
+	//transformPoints, the same points with one matrix
+	std::vector<Vector3> points_batch(n);
+	ns = timeBatch(n, repetitions, [&]() {
+		transformPoints(a[0], &points[0], &points_batch[0], n);
+		sink = sink + points_batch[n - 1].x;
+	});
+	error = 0.0;
+	for (int i = 0; i < n; ++i)
+		for (int j = 0; j < 3; ++j)
+		{
+			double value = a[0].m[12 + j] + (double)a[0].m[j] * points[i].x + (double)a[0].m[4 + j] * points[i].y + (double)a[0].m[8 + j] * points[i].z;
+			double magnitude = fabs(a[0].m[12 + j]) + fabs((double)a[0].m[j] * points[i].x) + fabs((double)a[0].m[4 + j] * points[i].y) + fabs((double)a[0].m[8 + j] * points[i].z);
+			error = std::max(error, fabs(value - points_batch[i].v[j]) / std::max(magnitude, 1e-30));
+		}
+	report("transformPoints", ns, error, 1e-5);
+
+	//transformBoundingBox
+	ns = timeBatch(n, repetitions, [&]() {
+		for (int i = 0; i < n; ++i)
+			boxes_result[i] = transformBoundingBox(a[i], boxes[i]);
+		sink = sink + boxes_result[n - 1].center.x;
+	});
+	error = 0.0;
+	for (int i = 0; i < n; ++i)
+	{
+		double center[3], halfsize[3];
+		referenceTransformBox(a[i], boxes[i], center, halfsize);
+		for (int j = 0; j < 3; ++j)
+		{
+			double scale = std::max(1.0, fabs(center[j]) + halfsize[j]);
+			error = std::max(error, fabs(center[j] - boxes_result[i].center.v[j]) / scale);
+			error = std::max(error, fabs(halfsize[j] - boxes_result[i].halfsize.v[j]) / scale);
+		}
+	}
+	report("transformBoundingBox", ns, error, 1e-4);
+
+	//Quaternion::slerp, above 0.95 the framework interpolates linearly so the tolerance is wider
+	ns = timeBatch(n, repetitions, [&]() {
+		for (int i = 0; i < n; ++i)
+			qa[i].slerp(qb[i], ts[i], q_result[i]);
+		sink = sink + q_result[n - 1].w;
+	});
+	error = 0.0;
+	for (int i = 0; i < n; ++i)
+	{
+		double reference[4];
+		referenceSlerp(qa[i], qb[i], ts[i], reference);
+		Quaternion q = q_result[i];
+		q.normalize();
+		double dot = fabs(reference[0] * q.x + reference[1] * q.y + reference[2] * q.z + reference[3] * q.w);
+		error = std::max(error, 1.0 - std::min(dot, 1.0));
+	}
+	report("Quaternion::slerp", ns, error, 1e-4);
+
+	//Quaternion::toMatrix, the rotated axes are in m[i], m[4 + i], m[8 + i]
+	ns = timeBatch(n, repetitions, [&]() {
+		for (int i = 0; i < n; ++i)
+			qa[i].toMatrix(results[i]);
+		sink = sink + results[n - 1].m[0];
+	});
+	error = 0.0;
+	for (int i = 0; i < n; ++i)
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			double v[3] = { axis == 0 ? 1.0 : 0.0, axis == 1 ? 1.0 : 0.0, axis == 2 ? 1.0 : 0.0 };
+			double reference[3];
+			referenceRotate(qa[i], v, reference);
+			for (int j = 0; j < 3; ++j)
+				error = std::max(error, fabs(reference[j] - results[i].m[j * 4 + axis]));
+		}
+	report("Quaternion::toMatrix", ns, error, 1e-5);
+
+	//Camera::testBoxInFrustum
+	Camera camera;
+	camera.setPerspective(60.0f, 16.0f / 9.0f, 1.0f, 5000.0f);
+	camera.lookAt(Vector3(0.0f, 100.0f, 300.0f), Vector3(0.0f, 0.0f, 0.0f), Vector3(0.0f, 1.0f, 0.0f));
+	ns = timeBatch(n, repetitions, [&]() {
+		for (int i = 0; i < n; ++i)
+			clip[i] = camera.testBoxInFrustum(boxes[i].center, boxes[i].halfsize);
+		sink = sink + clip[n - 1];
+	});
+	int mismatches = 0, checked = 0, outside = 0;
+	for (int i = 0; i < n; ++i)
+	{
+		double margin;
+		bool reference_outside = referenceBoxOutside(camera.viewprojection_matrix, boxes[i], margin);
+		outside += reference_outside;
+		if (margin < 1e-4)	//too close to the border of a plane to agree in float
+			continue;
+		checked++;
+		mismatches += reference_outside != (clip[i] == CLIP_OUTSIDE);
+	}
+	report("Camera::testBoxInFrustum", ns, checked ? mismatches / (double)checked : 0.0, 0.0);
+	printf("  %d of %d boxes outside\n", outside, n);
+
+	printf("\nchecksum %g\n%s\n", (double)sink, failures ? "FAILED" : "OK");
+	return failures ? 1 : 0;
+}
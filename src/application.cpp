@@ -4,6 +4,8 @@
 #include "texture.h"
 
 #include "fbo.h"
+#include "fbopool.h"
+#include "framegraph.h"
 #include "shader.h"
 #include "input.h"
 #include "includes.h"
@@ -13,6 +15,10 @@
 
 #include "entity.h"
 #include "scene.h"
+#include "glstate.h"
+#include "gpuprofiler.h"
+#include "cpuprofiler.h"
+#include "camerapath.h"
 
 #include <cmath>
 #include <string>
@@ -26,12 +32,16 @@ Vector4 bg_color(1.0, 1.0, 1.0, 1.0);
 Camera* camera = nullptr;
 GTR::Prefab* prefab = nullptr;
 GTR::Renderer* renderer = nullptr;
+FrameGraph* frame_graph = nullptr;
+CameraPath* camera_path = nullptr;
 FBO* fbo = nullptr;
 Texture* texture = nullptr;
 
+static UniformID u_camera_nearfar_id("u_camera_nearfar");
+
 float cam_speed = 10;
 
-Application::Application(int window_width, int window_height, SDL_Window* window)
+Application::Application(int window_width, int window_height, SDL_Window* window, const char* scene_name)
 {
 	this->window_width = window_width;
 	this->window_height = window_height;
@@ -45,6 +55,7 @@ Application::Application(int window_width, int window_height, SDL_Window* window
 	real_time_shadows = false;
 
 	render_wireframe = false;
+	fixed_timestep = 0.0f;
 
 	fps = 0;
 	frame = 0;
@@ -65,30 +76,43 @@ Application::Application(int window_width, int window_height, SDL_Window* window
 
 	//This class will be the one in charge of rendering all 
 	renderer = new GTR::Renderer(); //here so we have opengl ready in constructor
+	frame_graph = new FrameGraph(renderer->render_targets);
+	camera_path = new CameraPath();
 
 	//Lets load some object to render
 	prefab = GTR::Prefab::Get("data/prefabs/gmc/scene.gltf");
 
 	loadData();
 
-	Scene::getInstance()->generateScene(camera);
-	//Scene::getInstance()->generateTestScene();
+	if (!Scene::getInstance()->generate(scene_name, camera))
+		exit(1);
 
 	//testing purposes
 	PrefabEntity* car = new PrefabEntity(prefab);
 
-	//Scene::getInstance()->generateDepthMap(renderer);
+	//Scene::getInstance()->generateDepthMap(renderer, camera);
 
 	//hide the cursor
 	SDL_ShowCursor(!mouse_locked); //hide or show the mouse
 }
 
+Camera* Application::getCamera()
+{
+	return camera;
+}
+
 //what to do when the image has to be draw
 void Application::render(void)
 {
+	CPUZone zone("Application::render");
 	//be sure no errors present in opengl before start
 	checkGLErrors();
 
+	//the GL state could have been changed outside (ImGui, SDL), start tracking it again
+	GLState::newFrame();
+	GPUProfiler::newFrame();
+	renderer->render_targets->newFrame();
+
 	//set the clear color (the background color)
 	glClearColor(bg_color.x, bg_color.y, bg_color.z, bg_color.w );
 
@@ -96,47 +120,170 @@ void Application::render(void)
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
     checkGLErrors();
     
-	glEnable(GL_CULL_FACE);
+	GLState::enable(GL_CULL_FACE);
 	glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-	glEnable(GL_BLEND);
-	glEnable(GL_DEPTH_TEST);
+	GLState::enable(GL_BLEND);
+	GLState::enable(GL_DEPTH_TEST);
 
 	if (render_wireframe)
 		glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 	else
 		glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
 
+	//a path being played overrides the input, a path being recorded takes the view that is going to be rendered
+	if (camera_path->playing)
+	{
+		if (!camera_path->play(camera))
+			fixed_timestep = 0.0f;
+	}
+	else if (camera_path->recording)
+		camera_path->record(camera);
+
 	//set the camera as default (used by some functions in the framework)
 	camera->enable();
 
 	//Rendering The Scene
 	//-------------------
-	if (real_time_shadows) {
+	if (real_time_shadows)
 		Scene::getInstance()->update(camera);
-		Scene::getInstance()->generateDepthMap(renderer);
-	}
 
-	glEnable(GL_DEPTH_TEST);
-	//Scene::getInstance()->render(camera, renderer);
+	//the frame is described again every frame, passes whose results are not shown are not executed
+	FrameGraph& graph = *frame_graph;
+	graph.clear();
+
+	int backbuffer = graph.importResource("backbuffer");
+	int shadow_maps = graph.importResource("shadow_maps");	//kept between frames by the shadow cache
+	int gbuffers = graph.createTarget("gbuffers", renderer->getGBuffersDesc(window_width, window_height));
+	int hdr = graph.createTarget("hdr", renderer->getHDRDesc(window_width, window_height));
+	int luminance = graph.importResource("luminance");	//the exposure adapts to it over the next frames
+	int gbuffer_views = graph.importResource("gbuffer_views");
+	int light_views = graph.importResource("light_views");
+	graph.markOutput(backbuffer);
+	graph.markOutput(shadow_maps);
+	if (renderer->show_GBuffers)
+		graph.markOutput(gbuffer_views);
+	for (auto light : Scene::getInstance()->lightEntities)
+		if (light->show_shadowMap || light->show_camera)
+			graph.markOutput(light_views);
+
+	int pass = -1;
+	if (real_time_shadows)
+	{
+		pass = graph.addPass("shadows", [=]() {
+			Scene::getInstance()->generateDepthMap(renderer, camera);
+		});
+		graph.write(pass, shadow_maps);
+	}
 
-	Scene::getInstance()->renderDeferred(camera, renderer);
+	if (renderer->use_deferred)
+	{
+		pass = graph.addPass("gbuffers", [=, &graph]() {
+			GLState::enable(GL_DEPTH_TEST);
+			renderer->renderGBuffers(camera, graph.getTarget(gbuffers));
+		});
+		graph.write(pass, gbuffers);
+
+		pass = graph.addPass("lighting", [=, &graph]() {
+			//lights only change once per frame, after the shadow maps are updated
+			renderer->uploadLightsData();
+			FBO* target = graph.getTarget(hdr);
+			target->bind();
+			renderer->renderDeferredLighting(camera, graph.getTarget(gbuffers));
+			target->unbind();
+		});
+		graph.read(pass, gbuffers);
+	}
+	else
+	{
+		pass = graph.addPass("forward", [=, &graph]() {
+			renderer->uploadLightsData();
+			FBO* target = graph.getTarget(hdr);
+			target->bind();
+			glClearColor(bg_color.x, bg_color.y, bg_color.z, bg_color.w);
+			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			GLState::enable(GL_DEPTH_TEST);
+			renderer->renderScene(camera);
+			target->unbind();
+		});
+	}
+	graph.read(pass, shadow_maps);
+	graph.write(pass, hdr);
+
+	pass = graph.addPass("luminance", [=, &graph]() {
+		renderer->computeLuminance(graph.getTarget(hdr));
+	});
+	graph.read(pass, hdr);
+	graph.write(pass, luminance);
+
+	pass = graph.addPass("tonemap", [=, &graph]() {
+		renderer->updateExposure(elapsed_time);
+		renderer->renderTonemap(graph.getTarget(hdr));
+	});
+	graph.read(pass, hdr);
+	if (renderer->auto_exposure)
+		graph.read(pass, luminance);
+	graph.write(pass, backbuffer);
+
+	if (renderer->use_deferred)
+	{
+		pass = graph.addPass("gbuffer views", [=, &graph]() {
+			renderer->renderGBuffersDebug(camera, graph.getTarget(gbuffers));
+		});
+		graph.read(pass, gbuffers);
+		graph.write(pass, gbuffer_views);
+	}
 
 	//Rendering the debug options of the scene (shadowmaps, cameras etc)
+	pass = graph.addPass("light views", [=]() {
+		renderLightViews();
+	});
+	graph.read(pass, shadow_maps);
+	graph.write(pass, light_views);
 
+	//Draw the floor grid, helpful to have a reference point
+	if (render_debug && render_grid)
+	{
+		pass = graph.addPass("grid", []() {
+			drawGrid();
+		});
+		graph.write(pass, backbuffer);
+	}
+
+	graph.compile();
+	graph.execute();
+
+    //glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    GLState::disable(GL_DEPTH_TEST);
+    //render anything in the gui after this
+    
+	//the swap buffers is done in the main loop after this function
+}
+
+//the shadow map of the lights or the scene from their camera, in the bottom left corner
+void Application::renderLightViews()
+{
 	glViewport(0, 0, 300, 300);
 	for (auto light : Scene::getInstance()->lightEntities)
 	{
-		if (light->shadowMap && light->show_shadowMap)
+		if (light->shadow_rect.z && light->show_shadowMap && renderer->shadow_atlas)
 		{
-			Shader* shader = Shader::Get("depth");
+			//the whole atlas is drawn scaled and moved so only the tile of the light falls in the 300x300 corner
+			float scale = 300.0f / light->shadow_rect.z;
+			glViewport(-light->shadow_rect.x * scale, -light->shadow_rect.y * scale, renderer->shadow_atlas_size * scale, renderer->shadow_atlas_size * scale);
+			glScissor(0, 0, 300, 300);
+			glEnable(GL_SCISSOR_TEST);
+
+			Shader* shader = renderer->depth_shader;
 			shader->enable();
-			shader->setUniform("u_camera_nearfar",
-				Vector2(light->camera->near_plane, light->camera->far_plane));
-			if (light->light_type == lightType::SPOT || light->light_type == lightType::POINT_LIGHT)
-				light->shadowMap->toViewport(shader);
+			shader->setUniform(u_camera_nearfar_id, Vector2(light->camera->near_plane, light->camera->far_plane));
+			if (light->light_type == lightType::SPOT)
+				renderer->shadow_atlas->depth_texture->toViewport(shader);
 			else
-				light->fbo->depth_texture->toViewport();
+				renderer->shadow_atlas->depth_texture->toViewport();
 			shader->disable();
+
+			glDisable(GL_SCISSOR_TEST);
+			glViewport(0, 0, 300, 300);
 		}
 		else if (light->show_camera)
 		{
@@ -144,24 +291,17 @@ void Application::render(void)
 			Scene::getInstance()->render(light->camera, renderer);
 		}
 	}
-
-	//Draw the floor grid, helpful to have a reference point
-	if(render_debug && render_grid)
-		drawGrid();
-
-    //glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    glDisable(GL_DEPTH_TEST);
-    //render anything in the gui after this
-    
-	//the swap buffers is done in the main loop after this function
+	glViewport(0, 0, window_width, window_height);
 }
 
 void Application::update(double seconds_elapsed)
 {
+	CPUZone zone("Application::update");
 	float speed = seconds_elapsed * cam_speed; //the speed is defined by the seconds_elapsed so it goes constant
 	float orbit_speed = seconds_elapsed * 0.5;
 	
 	//Scene::getInstance()->update(seconds_elapsed, camera);
+	Scene::getInstance()->animate(seconds_elapsed);
 
 	//async input to move the camera around
 	if (Input::isKeyPressed(SDL_SCANCODE_LSHIFT)) speed *= 10; //move faster with left shift
@@ -293,6 +433,44 @@ void Application::renderDebugGUI(void)
 	ImGui::ColorEdit4("BG color", bg_color.v);
 	ImGui::Checkbox("Grid", &render_grid);
 	ImGui::Checkbox("Real Time Shadows", &real_time_shadows);
+	ImGui::Checkbox("Cache Shadows", &renderer->cache_shadows);
+	ImGui::Checkbox("Instancing", &renderer->use_instancing);
+	ImGui::SliderInt("Single Pass Lights", &renderer->max_single_pass_lights, 0, MAX_LIGHTS);
+	ImGui::Checkbox("Tiled Deferred", &renderer->tiled_deferred);
+	ImGui::Checkbox("Light Volumes", &renderer->use_light_volumes);
+	ImGui::Checkbox("Compact GBuffer", &renderer->compact_gbuffer);
+	ImGui::Checkbox("Show GBuffers", &renderer->show_GBuffers);
+	ImGui::Checkbox("Deferred", &renderer->use_deferred);
+	ImGui::Checkbox("Auto Exposure", &renderer->auto_exposure);
+	if (renderer->auto_exposure)
+	{
+		ImGui::SliderFloat("Exposure Key", &renderer->exposure_key, 0.01f, 1.0f);
+		ImGui::SliderFloat("Adaptation Speed", &renderer->exposure_adaptation, 0.1f, 10.0f);
+		ImGui::Text("Average luminance: %.3f, exposure: %.3f", renderer->average_luminance, renderer->exposure);
+	}
+	else
+		ImGui::SliderFloat("Exposure", &renderer->exposure, 0.01f, 16.0f);
+	ImGui::Text("GL state changes: %d applied, %d skipped", GLState::last_frame_applied, GLState::last_frame_skipped);
+	if (ImGui::TreeNode(frame_graph, "Frame graph")) {
+		frame_graph->renderInMenu();
+		ImGui::TreePop();
+	}
+	if (ImGui::TreeNode(camera_path, "Camera path")) {
+		camera_path->renderInMenu();
+		ImGui::TreePop();
+	}
+	if (ImGui::TreeNode("CPU profiler")) {
+		CPUProfiler::renderInMenu();
+		ImGui::TreePop();
+	}
+	if (ImGui::TreeNode("GPU profiler")) {
+		GPUProfiler::renderInMenu();
+		ImGui::TreePop();
+	}
+	if (ImGui::TreeNode(renderer->render_targets, "Render targets")) {
+		renderer->render_targets->renderInMenu();
+		ImGui::TreePop();
+	}
 
 	//add info to the debug panel about the camera
 	if (ImGui::TreeNode(camera, "Camera")) {
@@ -302,6 +480,24 @@ void Application::renderDebugGUI(void)
 
 	ImGui::Checkbox("Ambient Light", &Scene::getInstance()->ambient_light);
 
+	if (ImGui::TreeNode(&Scene::getInstance()->stress_desc, "Stress scene")) {
+		Scene::getInstance()->stress_desc.renderInMenu();
+		if (ImGui::Button("Generate"))
+		{
+			Scene::getInstance()->clear();
+			Scene::getInstance()->generateStressScene(Scene::getInstance()->stress_desc);
+		}
+		ImGui::TreePop();
+	}
+
+	//too many entities would make the panel slower than the frame
+	const int max_listed = 256;
+	if (Scene::getInstance()->lightEntities.size() + Scene::getInstance()->prefabEntities.size() > max_listed)
+	{
+		ImGui::Text("%d lights, %d prefabs", (int)Scene::getInstance()->lightEntities.size(), (int)Scene::getInstance()->prefabEntities.size());
+		return;
+	}
+
 	//LIGHTS
 	for (int i = 0; i < Scene::getInstance()->lightEntities.size(); i++)
 	{
@@ -334,8 +530,39 @@ void Application::onKeyDown( SDL_KeyboardEvent event )
 		case SDLK_ESCAPE: must_exit = true; break; //ESC key, kill the app
 		case SDLK_F1: render_debug = !render_debug; break;
 		case SDLK_f: camera->center.set(0, 0, 0); camera->updateViewMatrix(); break;
-		case SDLK_F5: Shader::ReloadAll(); break;
+		case SDLK_F5: Shader::ReloadAll(); renderer->loadShaders(); break;
+		case SDLK_F6: CPUProfiler::exportChromeTrace("trace.json"); break;
+		case SDLK_F7: toggleCameraRecording(); break;
+		case SDLK_F8: toggleCameraReplay(); break;
+	}
+}
+
+void Application::toggleCameraRecording()
+{
+	if (camera_path->recording)
+	{
+		camera_path->stopRecording();
+		camera_path->save("camera_path.bin");
 	}
+	else
+		camera_path->startRecording();
+}
+
+//plays the path recorded in this session or the last one saved
+void Application::toggleCameraReplay()
+{
+	if (camera_path->playing)
+	{
+		camera_path->stopPlaying();
+		fixed_timestep = 0.0f;
+		return;
+	}
+	if (camera_path->recording)
+		return;
+	if (camera_path->keys.empty() && !camera_path->load("camera_path.bin"))
+		return;
+	camera_path->startPlaying();
+	fixed_timestep = camera_path->timestep;
 }
 
 void Application::onKeyUp(SDL_KeyboardEvent event)
@@ -402,6 +629,10 @@ void Application::onResize(int width, int height)
 	camera->aspect =  width / (float)height;
 	window_width = width;
 	window_height = height;
+
+	//the targets of the old size are not going to be used again
+	if (renderer)
+		renderer->render_targets->trim();
 }
 
 void Application::loadData()
@@ -33,8 +33,11 @@ public:
 	//some vars
 	bool mouse_locked; //tells if the mouse is locked (blocked in the center and not visible)
 	bool render_wireframe; //in case we want to render everything in wireframe mode
+	float fixed_timestep; //when not zero every frame advances this time instead of the real one (to replay camera paths)
 
-	Application( int window_width, int window_height, SDL_Window* window );
+	Application( int window_width, int window_height, SDL_Window* window, const char* scene_name = "default" );
+
+	Camera* getCamera();
 
 	//main functions
 	void render( void );
@@ -42,6 +45,9 @@ public:
 
 	void renderDebugGUI(void);
 	void renderDebugGizmo();
+	void renderLightViews();
+	void toggleCameraRecording();
+	void toggleCameraReplay();
 
 	//events
 	void onKeyDown( SDL_KeyboardEvent event );
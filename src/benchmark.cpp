@@ -0,0 +1,225 @@
+#include "benchmark.h"
+#include "application.h"
+#include "camera.h"
+#include "mesh.h"
+#include "cpuprofiler.h"
+#include "camerapath.h"
+#include "scene.h"
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+sBenchmarkOptions::sBenchmarkOptions()
+{
+	enabled = false;
+	headless = false;
+	scene = "default";
+	frames = 1000;
+	warmup = 60;
+	width = 1280;
+	height = 720;
+	output = "benchmark.json";
+}
+
+bool sBenchmarkOptions::parse(int argc, char** argv)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		const char* arg = argv[i];
+		bool has_value = i + 1 < argc;
+		if (strcmp(arg, "--benchmark") == 0)
+			enabled = true;
+		else if (strcmp(arg, "--headless") == 0)
+			headless = true;
+		else if (strcmp(arg, "--scene") == 0 && has_value)
+			scene = argv[++i];
+		else if (strcmp(arg, "--frames") == 0 && has_value)
+			frames = atoi(argv[++i]);
+		else if (strcmp(arg, "--warmup") == 0 && has_value)
+			warmup = atoi(argv[++i]);
+		else if (strcmp(arg, "--size") == 0 && has_value)
+		{
+			if (sscanf(argv[++i], "%dx%d", &width, &height) != 2)
+				return false;
+		}
+		else if (strcmp(arg, "--camera-path") == 0 && has_value)
+			camera_path = argv[++i];
+		else if (strcmp(arg, "--output") == 0 && has_value)
+			output = argv[++i];
+		else if (Scene::getInstance()->stress_desc.parseArgument(argc, argv, i))
+			continue;
+		else
+		{
+			std::cout << "Error: unknown argument " << arg << std::endl;
+			return false;
+		}
+	}
+	return frames > 0 && warmup >= 0 && width > 0 && height > 0;
+}
+
+Benchmark::Benchmark(const sBenchmarkOptions& options)
+{
+	this->options = options;
+	path = NULL;
+	if (options.camera_path.size())
+	{
+		path = new CameraPath();
+		if (!path->load(options.camera_path.c_str()) || path->keys.empty())
+		{
+			delete path;
+			path = NULL;
+		}
+	}
+}
+
+Benchmark::~Benchmark()
+{
+	delete path;
+}
+
+//the measured frames follow the recorded path (looping if it is shorter), without it
+//one turn around the scene while going up and down, so the number of visible objects and lights changes
+void Benchmark::setCamera(int frame, Camera* camera)
+{
+	if (path)
+	{
+		path->getKey(std::max(frame - options.warmup, 0), camera);
+		return;
+	}
+	float t = frame / (float)(options.warmup + options.frames);
+	float angle = t * 2.0f * PI;
+	Vector3 eye(cos(angle) * 400.0f, 150.0f + sin(angle * 3.0f) * 100.0f, sin(angle) * 400.0f);
+	camera->lookAt(eye, Vector3(0.0f, 50.0f, 0.0f), Vector3(0.0f, 1.0f, 0.0f));
+}
+
+void Benchmark::run(Application* app, SDL_Window* window)
+{
+	const double dt = path ? path->timestep : 1.0 / 60.0;
+	int total = options.warmup + options.frames;
+	Camera* camera = app->getCamera();
+	app->render_gui = false;
+	app->render_debug = false;
+
+	//the timestamps of all the frames are read at the end, so measuring never stalls the GPU
+	std::vector<GLuint> queries(options.frames * 2);
+	glGenQueries((GLsizei)queries.size(), &queries[0]);
+	results.resize(options.frames);
+
+	if (options.camera_path.size() && !path)
+		std::cout << "Warning: the camera path could not be loaded, orbiting the scene" << std::endl;
+	std::cout << "Benchmark: scene " << options.scene << ", " << options.width << "x" << options.height << ", " << options.frames << " frames" << std::endl;
+	for (int i = 0; i < total; ++i)
+	{
+		SDL_PumpEvents();
+		CPUProfiler::newFrame();
+		Mesh::num_meshes_rendered = 0;
+		Mesh::num_triangles_rendered = 0;
+
+		app->time = float(i * dt);
+		app->elapsed_time = (float)dt;
+		app->frame++;
+
+		uint64_t start = CPUProfiler::getTime();
+		app->update(dt);
+		setCamera(i, camera);
+
+		int k = i - options.warmup;
+		if (k >= 0)
+			glQueryCounter(queries[k * 2], GL_TIMESTAMP);
+		app->render();
+		if (k >= 0)
+			glQueryCounter(queries[k * 2 + 1], GL_TIMESTAMP);
+		uint64_t submitted = CPUProfiler::getTime();
+		SDL_GL_SwapWindow(window);
+		uint64_t end = CPUProfiler::getTime();
+
+		if (k < 0)
+			continue;
+		sFrameStats& stats = results[k];
+		stats.cpu_ms = (submitted - start) * 0.000001;
+		stats.frame_ms = (end - start) * 0.000001;
+		stats.gpu_ms = 0.0;
+		stats.draw_calls = Mesh::num_meshes_rendered;
+		stats.triangles = Mesh::num_triangles_rendered;
+	}
+
+	glFinish();
+	for (int k = 0; k < options.frames; ++k)
+	{
+		GLuint64 begin = 0, end = 0;
+		glGetQueryObjectui64v(queries[k * 2], GL_QUERY_RESULT, &begin);
+		glGetQueryObjectui64v(queries[k * 2 + 1], GL_QUERY_RESULT, &end);
+		results[k].gpu_ms = (end - begin) * 0.000001;
+	}
+	glDeleteQueries((GLsizei)queries.size(), &queries[0]);
+}
+
+double Benchmark::getPercentile(std::vector<double> values, float p)
+{
+	if (values.empty())
+		return 0.0;
+	std::sort(values.begin(), values.end());
+	int index = std::min((int)(p * values.size()), (int)values.size() - 1);
+	return values[index];
+}
+
+bool Benchmark::save()
+{
+	FILE* file = fopen(options.output.c_str(), "wb");
+	if (!file)
+	{
+		std::cout << "Error: cannot write the benchmark results to " << options.output << std::endl;
+		return false;
+	}
+
+	std::string ext = options.output.size() > 4 ? options.output.substr(options.output.size() - 4) : "";
+	if (ext == ".csv")
+	{
+		fprintf(file, "frame,cpu_ms,gpu_ms,frame_ms,draw_calls,triangles\n");
+		for (int i = 0; i < results.size(); ++i)
+		{
+			sFrameStats& stats = results[i];
+			fprintf(file, "%d,%.4f,%.4f,%.4f,%ld,%ld\n", i, stats.cpu_ms, stats.gpu_ms, stats.frame_ms, stats.draw_calls, stats.triangles);
+		}
+	}
+	else
+	{
+		std::vector<double> cpu, gpu;
+		for (sFrameStats& stats : results)
+		{
+			cpu.push_back(stats.cpu_ms);
+			gpu.push_back(stats.gpu_ms);
+		}
+		fprintf(file, "{\n\t\"scene\": \"%s\",\n\t\"width\": %d,\n\t\"height\": %d,\n\t\"frames\": %d,\n\t\"warmup\": %d,\n", options.scene.c_str(), options.width, options.height, options.frames, options.warmup);
+		fprintf(file, "\t\"renderer\": \"%s\",\n", (const char*)glGetString(GL_RENDERER));
+		fprintf(file, "\t\"summary\": { \"cpu_p50\": %.4f, \"cpu_p95\": %.4f, \"gpu_p50\": %.4f, \"gpu_p95\": %.4f },\n",
+			getPercentile(cpu, 0.5f), getPercentile(cpu, 0.95f), getPercentile(gpu, 0.5f), getPercentile(gpu, 0.95f));
+		fprintf(file, "\t\"per_frame\": [\n");
+		for (int i = 0; i < results.size(); ++i)
+		{
+			sFrameStats& stats = results[i];
+			fprintf(file, "\t\t{ \"cpu_ms\": %.4f, \"gpu_ms\": %.4f, \"frame_ms\": %.4f, \"draw_calls\": %ld, \"triangles\": %ld }%s\n",
+				stats.cpu_ms, stats.gpu_ms, stats.frame_ms, stats.draw_calls, stats.triangles, i + 1 < results.size() ? "," : "");
+		}
+		fprintf(file, "\t]\n}\n");
+	}
+
+	fclose(file);
+	std::cout << "[OK] Benchmark results saved to " << options.output << std::endl;
+	return true;
+}
+
+void Benchmark::printSummary()
+{
+	std::vector<double> cpu, gpu, frame;
+	for (sFrameStats& stats : results)
+	{
+		cpu.push_back(stats.cpu_ms);
+		gpu.push_back(stats.gpu_ms);
+		frame.push_back(stats.frame_ms);
+	}
+	printf("           p50      p95      p99\n");
+	printf(" CPU  %8.3f %8.3f %8.3f ms\n", getPercentile(cpu, 0.5f), getPercentile(cpu, 0.95f), getPercentile(cpu, 0.99f));
+	printf(" GPU  %8.3f %8.3f %8.3f ms\n", getPercentile(gpu, 0.5f), getPercentile(gpu, 0.95f), getPercentile(gpu, 0.99f));
+	printf(" Frame%8.3f %8.3f %8.3f ms\n", getPercentile(frame, 0.5f), getPercentile(frame, 0.95f), getPercentile(frame, 0.99f));
+}
@@ -0,0 +1,62 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include "includes.h"
+#include "framework.h"
+#include <vector>
+#include <string>
+
+class Application;
+class Camera;
+class CameraPath;
+
+//how the benchmark is run, filled from the command line:
+//  --benchmark [--headless] [--scene name] [--frames n] [--warmup n] [--size WxH] [--camera-path file] [--output file.json|file.csv]
+//  and the options of the stress scene (see sStressSceneDesc), the scene can be chosen without --benchmark
+struct sBenchmarkOptions
+{
+	bool enabled;
+	bool headless;	//no visible window, with the SDL offscreen driver (EGL) so it runs without a display
+	std::string scene;
+	int frames;	//frames measured
+	int warmup;	//frames rendered before measuring (shader compilation, shadow caches...)
+	int width;
+	int height;
+	std::string output;
+	std::string camera_path;	//recorded with F7, otherwise the camera orbits the scene
+
+	sBenchmarkOptions();
+	bool parse(int argc, char** argv);	//false if the arguments are wrong
+};
+
+//Benchmark
+//renders a scene a fixed number of frames from a scripted camera path with a fixed timestep,
+//so two runs of the same build see exactly the same frames, and saves the cost of every frame
+
+class Benchmark {
+public:
+	struct sFrameStats
+	{
+		double cpu_ms;	//update and render, until the commands are submitted
+		double gpu_ms;	//between the first and the last command of the frame
+		double frame_ms;	//including the swap
+		long draw_calls;
+		long triangles;
+	};
+
+	sBenchmarkOptions options;
+	std::vector<sFrameStats> results;
+	CameraPath* path;	//NULL to orbit
+
+	Benchmark(const sBenchmarkOptions& options);
+	~Benchmark();
+
+	void setCamera(int frame, Camera* camera);	//frame from 0 to warmup + frames
+	void run(Application* app, SDL_Window* window);
+	bool save();	//json or csv depending on the extension of the output
+	void printSummary();
+
+	static double getPercentile(std::vector<double> values, float p);
+};
+
+#endif
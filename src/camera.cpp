@@ -1,8 +1,11 @@
 #include "camera.h"
-#include "utils.h"
 
-#include "includes.h"
+#ifndef SKIP_GL
+	#include "utils.h"
+	#include "includes.h"
+#endif
 #include <iostream>
+#include <cstring>
 
 Camera* Camera::current = NULL;
 
@@ -14,15 +17,19 @@ Camera::Camera()
 
 void Camera::enable()
 {
+#ifndef SKIP_GL
     checkGLErrors();
+#endif
 	current = this;
 	updateViewMatrix();
 	updateProjectionMatrix();
 	extractFrustum();
+#ifndef SKIP_GL
     checkGLErrors();
+#endif
 
 	//legacy rendering...
-#ifndef __APPLE__
+#if !defined(__APPLE__) && !defined(SKIP_GL)
 	glMatrixMode(GL_PROJECTION);
 	glLoadMatrixf(projection_matrix.m);
 	glMatrixMode(GL_MODELVIEW);
@@ -0,0 +1,150 @@
+#include "camerapath.h"
+#include "camera.h"
+#include <cstdio>
+#include <cstring>
+#include <cassert>
+
+#define CAMERAPATH_VERSION 1
+
+CameraPath::CameraPath()
+{
+	timestep = 1.0f / 60.0f;
+	recording = false;
+	playing = false;
+	loop = false;
+	current = 0;
+}
+
+void CameraPath::startRecording()
+{
+	stopPlaying();
+	keys.clear();
+	recording = true;
+}
+
+void CameraPath::stopRecording()
+{
+	recording = false;
+}
+
+void CameraPath::record(Camera* camera)
+{
+	sKey key;
+	key.eye = camera->eye;
+	key.center = camera->center;
+	key.up = camera->up;
+	key.fov = camera->fov;
+	keys.push_back(key);
+}
+
+void CameraPath::startPlaying()
+{
+	if (keys.empty())
+		return;
+	recording = false;
+	playing = true;
+	current = 0;
+}
+
+void CameraPath::stopPlaying()
+{
+	playing = false;
+}
+
+bool CameraPath::play(Camera* camera)
+{
+	if (current >= keys.size())
+	{
+		if (!loop)
+		{
+			playing = false;
+			return false;
+		}
+		current = 0;
+	}
+	getKey(current++, camera);
+	return true;
+}
+
+//the aspect and the planes are the ones of the camera, so a path can be played in a window of other size
+void CameraPath::getKey(int frame, Camera* camera)
+{
+	assert(keys.size());
+	sKey& key = keys[frame % keys.size()];
+	camera->lookAt(key.eye, key.center, key.up);
+	if (camera->type == Camera::PERSPECTIVE && camera->fov != key.fov)
+		camera->setPerspective(key.fov, camera->aspect, camera->near_plane, camera->far_plane);
+}
+
+bool CameraPath::save(const char* filename)
+{
+	FILE* file = fopen(filename, "wb");
+	if (!file)
+	{
+		std::cout << "Error: cannot write the camera path " << filename << std::endl;
+		return false;
+	}
+	unsigned int header[3] = { 0, CAMERAPATH_VERSION, (unsigned int)keys.size() };
+	memcpy(header, "CPTH", 4);
+	fwrite(header, sizeof(header), 1, file);
+	fwrite(&timestep, sizeof(float), 1, file);
+	if (keys.size())
+		fwrite(&keys[0], sizeof(sKey), keys.size(), file);
+	fclose(file);
+	std::cout << "[OK] Camera path of " << keys.size() << " frames saved to " << filename << std::endl;
+	return true;
+}
+
+bool CameraPath::load(const char* filename)
+{
+	FILE* file = fopen(filename, "rb");
+	if (!file)
+	{
+		std::cout << "Error: camera path not found " << filename << std::endl;
+		return false;
+	}
+	unsigned int header[3];
+	if (fread(header, sizeof(header), 1, file) != 1 || memcmp(header, "CPTH", 4) != 0 || header[1] != CAMERAPATH_VERSION)
+	{
+		std::cout << "Error: wrong camera path file " << filename << std::endl;
+		fclose(file);
+		return false;
+	}
+	//the number of keys must match the size of the file before allocating them
+	long start = ftell(file);
+	fseek(file, 0, SEEK_END);
+	long key_bytes = ftell(file) - start - (long)sizeof(float);
+	fseek(file, start, SEEK_SET);
+	if (key_bytes < 0 || key_bytes % sizeof(sKey) != 0 || key_bytes / sizeof(sKey) != header[2])
+	{
+		std::cout << "Error: the size of the camera path does not match its keys " << filename << std::endl;
+		fclose(file);
+		return false;
+	}
+
+	float loaded_timestep;
+	std::vector<sKey> loaded(header[2]);
+	bool ok = fread(&loaded_timestep, sizeof(float), 1, file) == 1;
+	if (ok && loaded.size())
+		ok = fread(&loaded[0], sizeof(sKey), loaded.size(), file) == loaded.size();
+	fclose(file);
+	if (!ok)
+	{
+		std::cout << "Error: camera path truncated " << filename << std::endl;
+		return false;
+	}
+	timestep = loaded_timestep;
+	keys = loaded;
+	current = 0;
+	return true;
+}
+
+void CameraPath::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	ImGui::Text("%s: %d frames (F7 record, F8 play)", recording ? "Recording" : (playing ? "Playing" : "Stopped"), (int)keys.size());
+	if (playing)
+		ImGui::ProgressBar(current / (float)keys.size());
+	ImGui::Checkbox("Loop", &loop);
+#endif
+}
@@ -0,0 +1,49 @@
+#ifndef CAMERAPATH_H
+#define CAMERAPATH_H
+
+#include "includes.h"
+#include "framework.h"
+#include <vector>
+
+class Camera;
+
+//CameraPath
+//the view of every frame (eye, center, up and fov) recorded while navigating, to be played again frame by frame
+//with a fixed timestep, so profiling sessions and before/after captures of a change see exactly the same frames
+//file: "CPTH", version, number of keys, timestep and the keys as floats
+
+class CameraPath {
+public:
+	struct sKey
+	{
+		Vector3 eye;
+		Vector3 center;
+		Vector3 up;
+		float fov;
+	};
+
+	std::vector<sKey> keys;
+	float timestep;	//seconds between keys when playing
+	bool recording;
+	bool playing;
+	bool loop;
+	int current;	//next key to play
+
+	CameraPath();
+
+	void startRecording();
+	void stopRecording();
+	void record(Camera* camera);	//adds the view of this frame
+
+	void startPlaying();
+	void stopPlaying();
+	bool play(Camera* camera);	//applies the next key, false when the path is over
+	void getKey(int frame, Camera* camera);	//applies any key
+
+	bool save(const char* filename);
+	bool load(const char* filename);
+
+	void renderInMenu();
+};
+
+#endif
@@ -0,0 +1,166 @@
+#include "cpuprofiler.h"
+#include <chrono>
+#include <cassert>
+#include <cstdio>
+#include <string>
+#include <algorithm>
+
+bool CPUProfiler::enabled = true;
+std::vector<CPUProfiler::sThreadBuffer*> CPUProfiler::threads;
+std::mutex CPUProfiler::threads_mutex;
+std::deque<CPUProfiler::sFrame> CPUProfiler::frames;
+uint64_t CPUProfiler::frame_start = 0;
+
+static thread_local CPUProfiler::sThreadBuffer* thread_buffer = NULL;
+static thread_local std::vector<CPUProfiler::sEvent> open_zones;	//begun and not ended, name NULL if not measured
+static const std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
+uint64_t CPUProfiler::getTime()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_time).count();
+}
+
+const char* CPUProfiler::intern(const std::string& name)
+{
+	static std::set<std::string> names;
+	static std::mutex names_mutex;
+	std::lock_guard<std::mutex> lock(names_mutex);
+	return names.insert(name).first->c_str();
+}
+
+//the buffer of a thread is created the first time it opens a zone and is never deleted
+CPUProfiler::sThreadBuffer* CPUProfiler::getThreadBuffer()
+{
+	if (thread_buffer)
+		return thread_buffer;
+	std::lock_guard<std::mutex> lock(threads_mutex);
+	thread_buffer = new sThreadBuffer();
+	thread_buffer->thread = (int)threads.size();
+	threads.push_back(thread_buffer);
+	return thread_buffer;
+}
+
+void CPUProfiler::begin(const char* name)
+{
+	sEvent event;
+	event.name = enabled ? name : NULL;
+	event.depth = (int)open_zones.size();
+	event.start = enabled ? getTime() : 0;
+	open_zones.push_back(event);
+}
+
+void CPUProfiler::end()
+{
+	assert(open_zones.size() && "CPUProfiler::end without begin");
+	sEvent event = open_zones.back();
+	open_zones.pop_back();
+	if (!event.name)
+		return;
+	event.end = getTime();
+
+	//the zone goes to the frame in which it ends
+	sThreadBuffer* buffer = getThreadBuffer();
+	event.thread = buffer->thread;
+	std::lock_guard<std::mutex> lock(buffer->mutex);
+	buffer->events.push_back(event);
+}
+
+void CPUProfiler::newFrame()
+{
+	uint64_t now = getTime();
+	if (frame_start)
+	{
+		sFrame frame;
+		frame.start = frame_start;
+		frame.end = now;
+		{
+			std::lock_guard<std::mutex> lock(threads_mutex);
+			for (sThreadBuffer* buffer : threads)
+			{
+				std::lock_guard<std::mutex> buffer_lock(buffer->mutex);
+				frame.events.insert(frame.events.end(), buffer->events.begin(), buffer->events.end());
+				buffer->events.clear();
+			}
+		}
+		frames.push_back(frame);
+		if (frames.size() > CPUPROFILER_HISTORY)
+			frames.pop_front();
+	}
+	frame_start = now;
+}
+
+//Trace Event Format, complete events with the times in microseconds
+bool CPUProfiler::exportChromeTrace(const char* filename)
+{
+	FILE* file = fopen(filename, "wb");
+	if (!file)
+	{
+		std::cout << "Error: cannot write the trace " << filename << std::endl;
+		return false;
+	}
+
+	fprintf(file, "{\"traceEvents\":[\n");
+	bool first = true;
+	for (sFrame& frame : frames)
+	{
+		fprintf(file, "%s{\"name\":\"frame\",\"ph\":\"X\",\"pid\":0,\"tid\":-1,\"ts\":%.3f,\"dur\":%.3f}", first ? "" : ",\n", frame.start * 0.001, (frame.end - frame.start) * 0.001);
+		first = false;
+		for (sEvent& event : frame.events)
+		{
+			std::string name;
+			for (const char* c = event.name; *c; ++c)
+			{
+				if (*c == '"' || *c == '\\')
+					name += '\\';
+				name += *c;
+			}
+			fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", name.c_str(), event.thread, event.start * 0.001, (event.end - event.start) * 0.001);
+		}
+	}
+	fprintf(file, "\n]}\n");
+	fclose(file);
+	std::cout << "[OK] Trace of " << frames.size() << " frames saved to " << filename << std::endl;
+	return true;
+}
+
+//the zones of the last frame of the main thread (the first that measured a zone), one row per depth
+void CPUProfiler::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	ImGui::Checkbox("Enabled", &enabled);
+	if (frames.empty())
+		return;
+	sFrame& frame = frames.back();
+	double frame_time = (frame.end - frame.start) * 0.000001;
+	ImGui::Text("Frame: %.3f ms, zones: %d (F6 saves a trace)", frame_time, (int)frame.events.size());
+
+	const float row_height = 18.0f;
+	int max_depth = 0;
+	for (sEvent& event : frame.events)
+		if (event.thread == 0)
+			max_depth = std::max(max_depth, event.depth);
+
+	ImVec2 origin = ImGui::GetCursorScreenPos();
+	float width = ImGui::GetContentRegionAvail().x;
+	float scale = width / (float)std::max(frame.end - frame.start, (uint64_t)1);
+	ImDrawList* draw_list = ImGui::GetWindowDrawList();
+	for (sEvent& event : frame.events)
+	{
+		if (event.thread != 0)
+			continue;
+		float x0 = origin.x + (float)(std::max(event.start, frame.start) - frame.start) * scale;
+		float x1 = origin.x + (float)(event.end - frame.start) * scale;
+		float y0 = origin.y + event.depth * row_height;
+		if (x1 - x0 < 1.0f)
+			x1 = x0 + 1.0f;
+		ImU32 color = ImColor::HSV((event.depth * 0.17f) - (int)(event.depth * 0.17f), 0.5f, 0.7f);
+		draw_list->AddRectFilled(ImVec2(x0, y0), ImVec2(x1, y0 + row_height - 1.0f), color);
+		draw_list->PushClipRect(ImVec2(x0, y0), ImVec2(x1, y0 + row_height), true);
+		draw_list->AddText(ImVec2(x0 + 2.0f, y0 + 2.0f), IM_COL32_WHITE, event.name);
+		draw_list->PopClipRect();
+		if (ImGui::IsMouseHoveringRect(ImVec2(x0, y0), ImVec2(x1, y0 + row_height)))
+			ImGui::SetTooltip("%s: %.3f ms", event.name, (event.end - event.start) * 0.000001);
+	}
+	ImGui::Dummy(ImVec2(width, (max_depth + 1) * row_height));
+#endif
+}
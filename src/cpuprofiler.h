@@ -0,0 +1,69 @@
+#ifndef CPUPROFILER_H
+#define CPUPROFILER_H
+
+#include "includes.h"
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <string>
+
+#define CPUPROFILER_HISTORY 120	//frames kept to be exported
+
+//CPUProfiler
+//scoped zones measured with a high resolution clock, cheap enough to be always on
+//every thread writes to its own buffer, the buffers are collected once per frame by newFrame
+//the last frames can be exported as a Chrome trace (chrome://tracing, Perfetto) and the last one is shown as a flame graph
+
+class CPUProfiler {
+public:
+	struct sEvent
+	{
+		const char* name;	//must live as long as the profiler (string literals)
+		uint64_t start;	//ns since the profiler started
+		uint64_t end;
+		int depth;
+		int thread;
+	};
+
+	struct sThreadBuffer
+	{
+		int thread;
+		std::vector<sEvent> events;	//zones of the current frame, added when they end
+		std::mutex mutex;	//only contended while newFrame collects the events
+	};
+
+	struct sFrame
+	{
+		uint64_t start;
+		uint64_t end;
+		std::vector<sEvent> events;
+	};
+
+	static bool enabled;
+	static std::vector<sThreadBuffer*> threads;
+	static std::mutex threads_mutex;
+	static std::deque<sFrame> frames;	//the last ones, the newest at the back
+	static uint64_t frame_start;
+
+	static uint64_t getTime();	//ns
+	static const char* intern(const std::string& name);	//a copy of a name that is not a literal, valid until the end
+	static void begin(const char* name);
+	static void end();
+	static void newFrame();	//closes the frame that was being recorded
+
+	static bool exportChromeTrace(const char* filename);
+	static void renderInMenu();
+
+private:
+	static sThreadBuffer* getThreadBuffer();
+};
+
+//begins a zone that ends with the scope
+struct CPUZone
+{
+	CPUZone(const char* name) { CPUProfiler::begin(name); }
+	~CPUZone() { CPUProfiler::end(); }
+};
+
+#endif
@@ -10,6 +10,7 @@
 #include "mesh.h"
 
 #include "shader.h"
+#include "glstate.h"
 
 class Application;
 
@@ -25,6 +26,49 @@ PrefabEntity::PrefabEntity(GTR::Prefab* pPrefab_)
 	selected = false;
 	pPrefab = pPrefab_;
 	factor = 1;
+
+	//so the first update counts as a movement
+	moved = true;
+	last_visible = false;
+}
+
+static void addNodeBounding(GTR::Node* node, const Matrix44& prefab_model, Vector3& min, Vector3& max)
+{
+	Matrix44 node_model = node->getGlobalMatrix(true) * prefab_model;
+	if (node->mesh)
+	{
+		BoundingBox box = transformBoundingBox(node_model, node->mesh->box);
+		Vector3 box_min = box.center - box.halfsize;
+		Vector3 box_max = box.center + box.halfsize;
+		min.set(std::min(min.x, box_min.x), std::min(min.y, box_min.y), std::min(min.z, box_min.z));
+		max.set(std::max(max.x, box_max.x), std::max(max.y, box_max.y), std::max(max.z, box_max.z));
+	}
+	for (int i = 0; i < node->children.size(); ++i)
+		addNodeBounding(node->children[i], prefab_model, min, max);
+}
+
+BoundingBox PrefabEntity::computeWorldBounding()
+{
+	Vector3 min(1e10, 1e10, 1e10);
+	Vector3 max(-1e10, -1e10, -1e10);
+	pPrefab->root.getGlobalMatrix();
+	addNodeBounding(&pPrefab->root, model, min, max);
+	if (min.x > max.x)
+		return BoundingBox(model.getTranslation(), Vector3(0, 0, 0));
+	return BoundingBox((min + max) * 0.5, (max - min) * 0.5);
+}
+
+void PrefabEntity::updateMovement()
+{
+	moved = visible != last_visible || memcmp(model.m, last_model.m, sizeof(Matrix44)) != 0;
+	if (!moved)
+		return;
+	last_world_bounding = world_bounding;
+	world_bounding = computeWorldBounding();
+	if (!last_visible) //it wasnt in any shadow map before
+		last_world_bounding = world_bounding;
+	last_model = model;
+	last_visible = visible;
 }
 
 void PrefabEntity::render(Camera* camera, GTR::Renderer* renderer) {
@@ -60,6 +104,8 @@ void PrefabEntity::renderInMenu()
 
 Light::Light(lightType type_)
 {
+	id = Scene::getInstance()->numLightEntities;
+	Scene::getInstance()->numLightEntities++;
 	light_type = type_;
 	entity_type = eType::LIGHT;
 	
@@ -74,10 +120,20 @@ Light::Light(lightType type_)
 	show_camera = false;
 	far_directional_shadowmap_updated = false;
 	is_cascade = false;
-	renderedHighShadow = false;
+	cascade_distance = 2000.0f;
+	cascade_split_lambda = 0.75f;
+	cascade_caster_distance = 1000.0f;
+	for (int i = 0; i < 5; ++i)
+		cascade_splits[i] = 0;
+
+	shadow_dirty = true;
+	cached_is_cascade = false;
+	shadow_renders = 0;
+	shadow_renders_skipped = 0;
+	point_shadow_slot = -1;
+	cached_point_shadow_slot = -1;
+	cached_maxdist = 0;
 
-	fbo = NULL;
-	shadowMap = NULL;	
 	mesh = new Mesh();
 	mesh->createPyramid();
 
@@ -106,6 +162,12 @@ Light::Light(lightType type_)
 	}
 }
 
+Light::~Light()
+{
+	delete camera;
+	delete mesh;
+}
+
 void Light::renderInMenu()
 {
 	ImGui::Text("Name: %s", name.c_str()); // Edit 3 floats representing a color
@@ -126,7 +188,18 @@ void Light::renderInMenu()
 		ImGui::Checkbox("Shadow map", &show_shadowMap);
 		ImGui::Checkbox("Show camera", &show_camera);
 		if (this->light_type == lightType::DIRECTIONAL)
+		{
 			ImGui::Checkbox("Activate cascade", &this->is_cascade);
+			if (is_cascade)
+			{
+				ImGui::DragFloat("Cascade distance", &cascade_distance, 10.0f, 10.0f, 10000.0f);
+				ImGui::SliderFloat("Log/linear splits", &cascade_split_lambda, 0.0f, 1.0f);
+				ImGui::DragFloat("Caster distance", &cascade_caster_distance, 10.0f, 0.0f, 10000.0f);
+			}
+		}
+		ImGui::Text("Shadow slices rendered: %d, cached: %d", shadow_renders, shadow_renders_skipped);
+		if (ImGui::Button("Update shadow"))
+			shadow_dirty = true;
 
 		if (ImGui::TreeNode(camera, "Camera light")) {
 			camera->renderInMenu();
@@ -166,189 +239,240 @@ void Light::updateDirectional(Camera* user_camera)
 	this->camera->lookAt(camera->eye, user_camera->eye, Vector3(0, 1, 0));
 }
 
-void Light::renderShadowMap(GTR::Renderer* renderer)
+//renders into the tile of the shadow atlas given by Renderer::allocateShadowAtlas, the atlas must be bound
+//point lights render into their own cubemap instead, with the atlas unbound
+void Light::renderShadowMap(GTR::Renderer* renderer, Camera* view_camera)
 {
-	if (this->light_type != lightType::SPOT && this->light_type != lightType::DIRECTIONAL &&
-		this->light_type != lightType::POINT_LIGHT)
+	if (this->light_type == lightType::POINT_LIGHT)
+	{
+		renderPointShadowMap(renderer);
 		return;
+	}
 
-	int w = 1024;
-	int h = 1024;
-
-	renderer->shadow = true;
+	if (this->light_type != lightType::SPOT && this->light_type != lightType::DIRECTIONAL)
+		return;
 
-	if (!this->fbo)
+	//no tile in the atlas this frame, other lights could use its old one
+	if (!this->camera || shadow_rect.z == 0)
 	{
-		if (light_type != lightType::POINT_LIGHT)
-		{
-			this->fbo = new FBO();
-			this->fbo->setDepthOnly(w, h);
-		}
-		else
-		{
-			this->fbo = new FBO();
-			this->fbo->setDepthOnly(w / 2, h * 3);
-		}
+		cached_shadow_rect.set(0, 0, 0, 0);
+		return;
+	}
 
+	//the layout of the shadow map changes
+	if (cached_is_cascade != is_cascade)
+	{
+		cached_is_cascade = is_cascade;
+		shadow_dirty = true;
 	}
 
-	if (!this->camera)
-		return;
+	//the tile moved or changed its size
+	if (cached_shadow_rect.x != shadow_rect.x || cached_shadow_rect.y != shadow_rect.y || cached_shadow_rect.z != shadow_rect.z)
+	{
+		cached_shadow_rect = shadow_rect;
+		shadow_dirty = true;
+	}
 
-	this->fbo->bind();
+	renderer->shadow = true;
 
 	this->camera->enable();
+	GLState::depthMask(true);
 
 	if (light_type == lightType::SPOT)
 	{
-		renderSpotShadowMap(renderer);
+		if (needsShadowUpdate(renderer, 0))
+			renderSpotShadowMap(renderer);
 	}
 	else if( light_type == lightType::DIRECTIONAL){
 
-		renderDirectionalShadowMap(renderer, is_cascade);
+		renderDirectionalShadowMap(renderer, is_cascade, view_camera);
 	}
 
-	this->fbo->unbind();
-
 	renderer->shadow = false;
+	shadow_dirty = false;
 
-	glDisable(GL_DEPTH_TEST);
-
-	this->shadowMap = this->fbo->depth_texture;
+	GLState::disable(GL_DEPTH_TEST);
 }
 
-void Light::renderSpotShadowMap(GTR::Renderer* renderer)
+//sets the viewport to a region of the atlas and clears only its depth
+static void beginShadowTile(int x, int y, int w, int h)
 {
-	int w = this->fbo->depth_texture->width;
-	int h = this->fbo->depth_texture->height;
-
+	glViewport(x, y, w, h);
+	glScissor(x, y, w, h);
+	glEnable(GL_SCISSOR_TEST);
 	glClear(GL_DEPTH_BUFFER_BIT);
-	glViewport(0, 0, w, h);
+	glDisable(GL_SCISSOR_TEST);
+}
+
+//checks if a slice must be rendered again with the current matrix of the light camera, and keeps the counters
+bool Light::needsShadowUpdate(GTR::Renderer* renderer, int slice)
+{
+	Matrix44& vp = camera->viewprojection_matrix;
+	bool dirty = shadow_dirty || !renderer->cache_shadows ||
+		memcmp(vp.m, cached_viewprojection[slice].m, sizeof(Matrix44)) != 0 ||
+		Scene::getInstance()->castersMovedInFrustum(camera);
 
-	for (auto& entity : Scene::getInstance()->prefabEntities)
+	if (!dirty)
 	{
-		renderer->renderPrefab(entity->model, entity->pPrefab, this->camera);
+		shadow_renders_skipped++;
+		return false;
 	}
+	cached_viewprojection[slice] = vp;
+	shadow_renders++;
+	return true;
 }
 
-void Light::renderDirectionalShadowMap(GTR::Renderer* renderer, bool is_cascade)
+//the cubemap only depends on the position and range of the light, so it is reused while they and the casters around dont change
+void Light::renderPointShadowMap(GTR::Renderer* renderer)
 {
+	if (point_shadow_slot < 0)
+	{
+		cached_point_shadow_slot = -1;
+		return;
+	}
 
-	float texture_width = this->fbo->depth_texture->width;
-	float texture_height = this->fbo->depth_texture->height;
-	float w = 512.0f;
-	float h = 512.0f;
-	float grid;
-
-	//if (!far_directional_shadowmap_updated)
-		glClear(GL_DEPTH_BUFFER_BIT);
-
-	Texture* background = Texture::getWhiteTexture();
+	Vector3 position = model.getTranslation();
+	bool dirty = shadow_dirty || !renderer->cache_shadows ||
+		cached_point_shadow_slot != point_shadow_slot ||
+		cached_position.x != position.x || cached_position.y != position.y || cached_position.z != position.z ||
+		cached_maxdist != maxDist ||
+		Scene::getInstance()->castersMovedInSphere(position, maxDist);
+	shadow_dirty = false;
 
-	if (!is_cascade)
+	if (!dirty)
 	{
-		this->camera->setOrthographic(-w / 2.0f, w / 2.0f, -h / 2.0f, h / 2.0f,
-			this->camera->near_plane, this->camera->far_plane);
+		shadow_renders_skipped++;
+		return;
+	}
+	cached_point_shadow_slot = point_shadow_slot;
+	cached_position = position;
+	cached_maxdist = maxDist;
+	shadow_renders++;
 
-		grid = w / (texture_width * 0.5f);
-		camera->view_matrix.M[3][1] = round(camera->view_matrix.M[3][1] / grid) * grid;
-		camera->view_matrix.M[3][0] = round(camera->view_matrix.M[3][0] / grid) * grid;
+	renderer->renderPointShadowMap(this);
+}
 
-		this->camera->viewprojection_matrix = camera->view_matrix * camera->projection_matrix;
+void Light::renderSpotShadowMap(GTR::Renderer* renderer)
+{
+	beginShadowTile(shadow_rect.x, shadow_rect.y, shadow_rect.z, shadow_rect.w);
 
-		for (auto& entity : Scene::getInstance()->prefabEntities)
-		{
-			renderer->renderPrefab(entity->model, entity->pPrefab, this->camera);
-		}
-	}
-	else {
+	renderer->renderScene(this->camera);
+}
 
-		//first quadrant
-		//--------------
-		this->camera->setOrthographic(-w / 4.0f, w / 4.0f, -h / 4.0f, h / 4.0f,
-			this->camera->near_plane, this->camera->far_plane);
+//sets the light camera to an orthographic box around the bounding sphere of a slice of the view frustum
+//the size of the sphere doesnt change when the view rotates, and its position is snapped to the texels, so the shadows dont shimmer
+void Light::fitCascade(Camera* view_camera, int cascade, float resolution)
+{
+	Vector3 light_dir = normalize(camera->center - camera->eye);
 
-		this->camera->updateProjectionMatrix();
+	//corners of the slice
+	Vector3 front = normalize(view_camera->center - view_camera->eye);
+	Vector3 right = normalize(front.cross(view_camera->up));
+	Vector3 up = right.cross(front);
+	float tan_half_fov = (float)tan(view_camera->fov * 0.5f * DEG2RAD);
 
-		glViewport(0, 0, texture_width / 2.0f, texture_height / 2.0f);
+	Vector3 corners[8];
+	for (int i = 0; i < 2; ++i)
+	{
+		float dist = cascade_splits[cascade + i];
+		float half_height = tan_half_fov * dist;
+		float half_width = half_height * view_camera->aspect;
+		Vector3 slice_center = view_camera->eye + front * dist;
+		corners[i * 4 + 0] = slice_center + right * half_width + up * half_height;
+		corners[i * 4 + 1] = slice_center - right * half_width + up * half_height;
+		corners[i * 4 + 2] = slice_center + right * half_width - up * half_height;
+		corners[i * 4 + 3] = slice_center - right * half_width - up * half_height;
+	}
 
-		//in order to find the size of each pixel in world coordinates we need to take the width of the frustum
-		//divided by the texture size. Since the texture is an atlas texture we have to divide it by the size of 
-		//each real texture and not the whole texture (in this case just the half of the whole texture since each
-		//texture occupies a quarter of the whole)
-		//once the calculations are done, we round the position of the camera to make it fit into the grid
-		grid = (w * 0.5f) / (texture_width * 0.5f);
-		camera->view_matrix.M[3][1] = round(camera->view_matrix.M[3][1] / grid) * grid;
-		camera->view_matrix.M[3][0] = round(camera->view_matrix.M[3][0] / grid) * grid;
-		this->camera->viewprojection_matrix = camera->view_matrix * camera->projection_matrix;
+	Vector3 center;
+	for (int i = 0; i < 8; ++i)
+		center = center + corners[i];
+	center = center * (1.0f / 8.0f);
+	float radius = 0;
+	for (int i = 0; i < 8; ++i)
+		radius = std::max(radius, (float)center.distance(corners[i]));
+	radius = ceil(radius * 16.0f) / 16.0f; //avoids precision changes in the size
+
+	//the box starts far enough towards the light to include the casters of the slice
+	float back = radius + cascade_caster_distance;
+	camera->lookAt(center - light_dir * back, center, fabs(light_dir.y) > 0.99f ? Vector3(0, 0, 1) : Vector3(0, 1, 0));
+	camera->setOrthographic(-radius, radius, -radius, radius, 0.0f, back + radius);
+
+	//move the camera in texel steps (also in depth, so the cached cascade is reused while the view doesnt move a texel)
+	float grid = (radius * 2.0f) / resolution;
+	camera->view_matrix.M[3][0] = round(camera->view_matrix.M[3][0] / grid) * grid;
+	camera->view_matrix.M[3][1] = round(camera->view_matrix.M[3][1] / grid) * grid;
+	camera->view_matrix.M[3][2] = round(camera->view_matrix.M[3][2] / grid) * grid;
+	camera->viewprojection_matrix = camera->view_matrix * camera->projection_matrix;
+	camera->extractFrustum();
+}
 
-		this->shadow_viewprojection[0] = camera->viewprojection_matrix;
-		//this->shadow_viewprojection[0] = camera->viewprojection_matrix;
+void Light::renderDirectionalShadowMap(GTR::Renderer* renderer, bool is_cascade, Camera* view_camera)
+{
 
-		for (auto& entity : Scene::getInstance()->prefabEntities)
-		{
-			renderer->renderPrefab(entity->model, entity->pPrefab, this->camera);
-		}
+	//size of the tile of the light in the atlas
+	float texture_width = shadow_rect.z;
+	float texture_height = shadow_rect.w;
+	float w = 512.0f;
+	float h = 512.0f;
+	float grid;
 
-		//second quadrant
-		//---------------
+	if (!is_cascade)
+	{
 		this->camera->setOrthographic(-w / 2.0f, w / 2.0f, -h / 2.0f, h / 2.0f,
 			this->camera->near_plane, this->camera->far_plane);
 
-		glViewport(texture_width / 2.0f, 0, texture_width / 2.0f, texture_height / 2.0f);
-
-		grid = w / (this->fbo->depth_texture->width / 2);
+		grid = w / (texture_width * 0.5f);
 		camera->view_matrix.M[3][1] = round(camera->view_matrix.M[3][1] / grid) * grid;
 		camera->view_matrix.M[3][0] = round(camera->view_matrix.M[3][0] / grid) * grid;
-		camera->viewprojection_matrix = camera->view_matrix * camera->projection_matrix;
-
-		this->shadow_viewprojection[1] = camera->viewprojection_matrix;
-
-		for (auto& entity : Scene::getInstance()->prefabEntities)
-		{
-			renderer->renderPrefab(entity->model, entity->pPrefab, this->camera);
-		}
 
-		//third quadrant
-		//--------------
-		this->camera->setOrthographic(-w, w, -h, h, this->camera->near_plane, this->camera->far_plane);
+		this->camera->viewprojection_matrix = camera->view_matrix * camera->projection_matrix;
+		this->camera->extractFrustum();
 
-		glViewport(0, texture_height / 2, texture_width / 2, texture_height / 2);
+		if (!needsShadowUpdate(renderer, 0))
+			return;
 
-		grid = (w * 2.0) / (this->fbo->depth_texture->width / 2);
-		camera->view_matrix.M[3][1] = round(camera->view_matrix.M[3][1] / grid) * grid;
-		camera->view_matrix.M[3][0] = round(camera->view_matrix.M[3][0] / grid) * grid;
-		camera->viewprojection_matrix = camera->view_matrix * camera->projection_matrix;
+		beginShadowTile(shadow_rect.x, shadow_rect.y, texture_width, texture_height);
+		renderer->renderScene(this->camera);
+		return;
+	}
 
-		shadow_viewprojection[2] = camera->viewprojection_matrix;
+	//the view distance is split mixing a logarithmic and a linear distribution
+	float near_plane = view_camera->near_plane;
+	float far_plane = std::min(view_camera->far_plane, cascade_distance);
+	for (int i = 0; i <= 4; ++i)
+	{
+		float f = i / 4.0f;
+		float log_split = near_plane * pow(far_plane / near_plane, f);
+		float linear_split = near_plane + (far_plane - near_plane) * f;
+		cascade_splits[i] = cascade_split_lambda * log_split + (1.0f - cascade_split_lambda) * linear_split;
+	}
 
-		for (auto& entity : Scene::getInstance()->prefabEntities)
-		{
-			renderer->renderPrefab(entity->model, entity->pPrefab, this->camera);
-		}
+	//every cascade uses a quadrant of the tile:
+	//first one bottom left, second bottom right, third top left and fourth top right
+	float light_near = camera->near_plane;
+	float light_far = camera->far_plane;
+	for (int i = 0; i < 4; ++i)
+	{
+		fitCascade(view_camera, i, texture_width * 0.5f);
 
-		//fourth quadrant
-		//---------------
-		this->camera->setOrthographic(-2 * w, 2 * w, -2 * h, 2 * h / 2,
-			this->camera->near_plane, this->camera->far_plane);
+		this->shadow_viewprojection[i] = camera->viewprojection_matrix;
 
-		glViewport(texture_width / 2, texture_height / 2, texture_width / 2, texture_height / 2);
+		//the cascade didnt snap to a new position and nothing moved inside
+		if (!needsShadowUpdate(renderer, i))
+			continue;
 
-		grid = (w * 4.0) / (this->fbo->depth_texture->width / 2);
-		camera->view_matrix.M[3][1] = round(camera->view_matrix.M[3][1] / grid) * grid;
-		camera->view_matrix.M[3][0] = round(camera->view_matrix.M[3][0] / grid) * grid;
-		camera->viewprojection_matrix = camera->view_matrix * camera->projection_matrix;
+		int x = shadow_rect.x + (i % 2) * texture_width / 2;
+		int y = shadow_rect.y + (i / 2) * texture_height / 2;
+		beginShadowTile(x, y, texture_width / 2, texture_height / 2);
 
-		if (!renderedHighShadow) {
-			this->shadow_viewprojection[3] = camera->viewprojection_matrix;
-			renderedHighShadow = true;
-		}
+		//the frustum of the light camera is the box of the cascade, so only its casters are rendered
+		renderer->renderScene(this->camera);
+	}
 
-		for (auto& entity : Scene::getInstance()->prefabEntities)
-		{
-			renderer->renderPrefab(entity->model, entity->pPrefab, this->camera);
-		}
+	//keep the planes of the scene for the non cascade shadow
+	camera->near_plane = light_near;
+	camera->far_plane = light_far;
 
-		far_directional_shadowmap_updated = true;
-	}
-}
\ No newline at end of file
+	far_directional_shadowmap_updated = true;
+}
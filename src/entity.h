@@ -31,6 +31,7 @@ public:
 	std::string name;
 	eType entity_type;
 
+	virtual ~Entity() {}
 	virtual void render(Camera* camera, GTR::Renderer* renderer) = 0;
 	virtual void renderInMenu() = 0;
 };
@@ -47,6 +48,16 @@ public:
 	void renderDeferred(Camera* camera, GTR::Renderer* renderer);
 	void renderInMenu();
 	void setPosition(float x, float y, float z) { this->model.translate(x, y, z); }
+
+	//movement since the last update, the shadow maps that could see it must be rendered again
+	bool moved;
+	Matrix44 last_model;
+	bool last_visible;
+	BoundingBox world_bounding;	//of all the nodes
+	BoundingBox last_world_bounding;	//before moving
+
+	void updateMovement();
+	BoundingBox computeWorldBounding();
 };
 
 class Light : public Entity {
@@ -61,21 +72,39 @@ public:
 	bool far_directional_shadowmap_updated;
 	bool is_cascade;	//only for directional lights
 
+	//cascades, fitted to slices of the view frustum
+	float cascade_distance;	//distance from the camera covered by the cascades
+	float cascade_split_lambda;	//0 splits the distance linearly, 1 logarithmically
+	float cascade_caster_distance;	//how far towards the light the casters are taken into account
+	float cascade_splits[5];	//distance from the camera where every cascade starts and ends
+
 	bool show_shadowMap;	//tell if shadow map is being shown
 	bool show_camera;	//debuggin purposes
-	bool renderedHighShadow;
+
+	//shadow caching: a slice of the shadow map is only rendered when its matrix changed or a caster moved inside it
+	bool shadow_dirty;	//forces to render all the slices in the next update
+	bool cached_is_cascade;
+	Vector4 cached_shadow_rect;
+	Matrix44 cached_viewprojection[4];	//matrix of every slice when it was rendered
+	int shadow_renders;	//slices rendered
+	int shadow_renders_skipped;	//slices reused from the previous frames
 
 	Camera* camera;
-	Texture* shadowMap;
-	FBO* fbo;
 	Mesh* mesh;
 
+	Vector4 shadow_rect;	//x, y, width and height in pixels of its tile in the shadow atlas (width 0 if it has none)
+	int point_shadow_slot;	//cubemap of the renderer used by a point light (-1 if it has none)
+	int cached_point_shadow_slot;
+	Vector3 cached_position;	//of a point light when its cubemap was rendered
+	float cached_maxdist;
+
 	Matrix44 shadow_viewprojection[4];
 	Matrix44 shadow_cubemap[6];
 
 	lightType light_type;
 
 	Light(lightType type_);
+	~Light();
 
 	void render(Camera* camera, GTR::Renderer* renderer) {};
 	void renderInMenu();
@@ -84,11 +113,14 @@ public:
 	void setColor(float r, float g, float b);
 
 	void updateDirectional(Camera* camera);
-	void renderShadowMap(GTR::Renderer* renderer);
+	void renderShadowMap(GTR::Renderer* renderer, Camera* view_camera);
 
 private:
-	void renderDirectionalShadowMap(GTR::Renderer* renderer, bool is_cascade);
+	bool needsShadowUpdate(GTR::Renderer* renderer, int slice);
+	void renderDirectionalShadowMap(GTR::Renderer* renderer, bool is_cascade, Camera* view_camera);
+	void fitCascade(Camera* view_camera, int cascade, float resolution);
 	void renderSpotShadowMap(GTR::Renderer* renderer);
+	void renderPointShadowMap(GTR::Renderer* renderer);
 };
 
 #endif // !ENTITY_H
\ No newline at end of file
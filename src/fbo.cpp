@@ -1,4 +1,5 @@
 #include "fbo.h"
+#include "glstate.h"
 #include <cassert>
 #include "utils.h"
 
@@ -20,7 +21,10 @@ FBO::~FBO()
 {
 	freeTextures();
 	if (fbo_id)
+	{
 		glDeleteFramebuffers(1, &fbo_id);
+		GLState::invalidate(); //the id could be reused by a new framebuffer
+	}
 	if (renderbuffer_color)
 		glDeleteRenderbuffersEXT(1, &renderbuffer_color);
 	if (renderbuffer_depth)
@@ -51,7 +55,7 @@ void FBO::freeTextures()
 	owns_textures = false;
 }
 
-bool FBO::create( int width, int height, int num_textures, int format, int type, bool use_depth_texture)
+bool FBO::create( int width, int height, int num_textures, int format, int type, bool use_depth_texture, const int* internal_formats)
 {
 	assert(glGetError() == GL_NO_ERROR);
 	assert(width && height);
@@ -60,13 +64,12 @@ bool FBO::create( int width, int height, int num_textures, int format, int type,
 
 	num_color_textures = num_textures;
 
-	int internalFormat = 0; //GL_RGB
-
 	std::vector<Texture*> textures(4);
 	for (int i = 0; i < num_textures; ++i)
 	{
+		int internalFormat = internal_formats ? internal_formats[i] : 0; //0 uses the format
 		Texture* colortex = textures[i] = new Texture(width, height, format, type, false, NULL, internalFormat );
-		glBindTexture(colortex->texture_type, colortex->texture_id);	//we activate this id to tell opengl we are going to use this texture
+		GLState::bindTexture(colortex->texture_type, colortex->texture_id);	//we activate this id to tell opengl we are going to use this texture
 		glTexParameteri(colortex->texture_type, GL_TEXTURE_MAG_FILTER, GL_NEAREST);	//set the min filter
 		glTexParameteri(colortex->texture_type, GL_TEXTURE_MIN_FILTER, GL_NEAREST);   //set the mag filter
 		glTexParameteri(colortex->texture_type, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
@@ -118,7 +121,7 @@ bool FBO::setTextures(std::vector<Texture*> textures, Texture* depth_texture, in
 	//create and bind FBO
 	if(fbo_id == 0)
 		glGenFramebuffersEXT(1, &fbo_id);
-	glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, fbo_id);
+	GLState::bindFramebuffer(fbo_id);
 	checkGLErrors();
 
 	if (depth_texture)
@@ -186,7 +189,7 @@ bool FBO::setTextures(std::vector<Texture*> textures, Texture* depth_texture, in
 		assert(0);
 		return false;
 	}
-	glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+	GLState::bindFramebuffer(0);
 
 	checkGLErrors();
 	return true;
@@ -198,18 +201,44 @@ bool FBO::setDepthOnly(int width, int height)
 	memset(bufs, 0, sizeof(bufs));
 	num_color_textures = 0;
 
-	glGenFramebuffersEXT(1, &fbo_id);
-	glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, fbo_id);
+	this->width = width;
+	this->height = height;
 
-	glGenRenderbuffersEXT(1, &renderbuffer_color);
-	glBindRenderbufferEXT(GL_RENDERBUFFER_EXT, renderbuffer_color);
-
-	glRenderbufferStorageEXT(GL_RENDERBUFFER_EXT, GL_RGBA, width, height);
-	glFramebufferRenderbufferEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER_EXT, renderbuffer_color);
+	glGenFramebuffersEXT(1, &fbo_id);
+	GLState::bindFramebuffer(fbo_id);
 
-	//create texture
+	//create texture, there is no color attachment so only the depth is written
 	depth_texture = new Texture(width, height, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, false);
 	glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth_texture->texture_id, 0);
+	glReadBuffer(GL_NONE);
+
+	GLenum status = glCheckFramebufferStatusEXT(GL_FRAMEBUFFER_EXT);
+	if (status != GL_FRAMEBUFFER_COMPLETE_EXT)
+	{
+		std::cout << "Error: Framebuffer object is not completed" << std::endl;
+		return false;
+	}
+	GLState::bindFramebuffer(0);
+	return true;
+}
+
+bool FBO::setDepthCubemap(Texture* cubemap)
+{
+	assert(cubemap && cubemap->texture_type == GL_TEXTURE_CUBE_MAP);
+	owns_textures = false;
+	memset(bufs, 0, sizeof(bufs)); //no color, every draw buffer is GL_NONE
+	num_color_textures = 0;
+	depth_texture = cubemap;
+	width = (int)cubemap->width;
+	height = (int)cubemap->height;
+
+	if (fbo_id == 0)
+		glGenFramebuffersEXT(1, &fbo_id);
+	GLState::bindFramebuffer(fbo_id);
+
+	//layered attachment: the six faces, the geometry shader selects one with gl_Layer
+	glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, cubemap->texture_id, 0);
+	glReadBuffer(GL_NONE);
 
 	GLenum status = glCheckFramebufferStatusEXT(GL_FRAMEBUFFER_EXT);
 	if (status != GL_FRAMEBUFFER_COMPLETE_EXT)
@@ -217,16 +246,37 @@ bool FBO::setDepthOnly(int width, int height)
 		std::cout << "Error: Framebuffer object is not completed" << std::endl;
 		return false;
 	}
-	glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+	GLState::bindFramebuffer(0);
 	return true;
 }
 
+void FBO::invalidateContents()
+{
+#ifndef __APPLE__
+	#ifdef USE_GLEW
+	if (!glInvalidateFramebuffer) //GL 4.3 or ARB_invalidate_subdata
+		return;
+	#endif
+	GLenum attachments[5];
+	int num = 0;
+	for (int i = 0; i < 4; ++i)
+		if (color_textures[i])
+			attachments[num++] = GL_COLOR_ATTACHMENT0 + i;
+	if (depth_texture || renderbuffer_depth)
+		attachments[num++] = GL_DEPTH_ATTACHMENT;
+
+	GLState::bindFramebuffer(fbo_id);
+	glInvalidateFramebuffer(GL_FRAMEBUFFER, num, attachments);
+	GLState::bindFramebuffer(0);
+#endif
+}
+
 void FBO::bind()
 {
 	assert(glGetError() == GL_NO_ERROR);
 	Texture* tex = color_textures[0] ? color_textures[0] : depth_texture;
 	assert(tex && "framebuffer without texture");
-	glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, fbo_id);
+	GLState::bindFramebuffer(fbo_id);
 	checkGLErrors();
 	glPushAttrib(GL_VIEWPORT_BIT);
 	glDrawBuffers(4, bufs);
@@ -240,7 +290,7 @@ void FBO::unbind()
 {
 	// output goes to the FBO and its attached buffers
 	glPopAttrib();
-	glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+	GLState::bindFramebuffer(0);
 	//glDrawBuffers(1, &one_buffer);
 	assert(glGetError() == GL_NO_ERROR);
 }
@@ -24,10 +24,12 @@ public:
 	FBO();
 	~FBO();
 
-	bool create(int width, int height, int num_textures = 1, int format = GL_RGB, int type = GL_UNSIGNED_BYTE, bool use_depth_texture = true );
+	bool create(int width, int height, int num_textures = 1, int format = GL_RGB, int type = GL_UNSIGNED_BYTE, bool use_depth_texture = true, const int* internal_formats = NULL ); //internal_formats, if any, one per texture
 	bool setTexture(Texture* texture, int cubemap_face = -1);
 	bool setTextures(std::vector<Texture*> textures, Texture* depth = NULL, int cubemap_face = -1);
 	bool setDepthOnly(int width, int height); //use this for shadowmaps
+	bool setDepthCubemap(Texture* cubemap); //all the faces at once, for point light shadows
+	void invalidateContents(); //tells the driver the content is not needed anymore (it doesnt have to be stored)
 	
 	void bind();
 	void unbind();
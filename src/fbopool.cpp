@@ -0,0 +1,148 @@
+#include "fbopool.h"
+#include "fbo.h"
+#include <cassert>
+
+sRenderTargetDesc::sRenderTargetDesc()
+{
+	width = height = num_textures = 0;
+	memset(internal_formats, 0, sizeof(internal_formats));
+	depth = true;
+}
+
+sRenderTargetDesc::sRenderTargetDesc(int width, int height, int num_textures, const int* internal_formats, bool depth)
+{
+	assert(num_textures >= 0 && num_textures <= 4);
+	this->width = width;
+	this->height = height;
+	this->num_textures = num_textures;
+	memset(this->internal_formats, 0, sizeof(this->internal_formats));
+	for (int i = 0; i < num_textures; ++i)
+		this->internal_formats[i] = internal_formats[i];
+	this->depth = depth;
+}
+
+bool sRenderTargetDesc::operator==(const sRenderTargetDesc& other) const
+{
+	return width == other.width && height == other.height && num_textures == other.num_textures && depth == other.depth &&
+		memcmp(internal_formats, other.internal_formats, sizeof(internal_formats)) == 0;
+}
+
+FBOPool::FBOPool()
+{
+	frame = 0;
+	max_unused_frames = 2;
+}
+
+FBOPool::~FBOPool()
+{
+	clear();
+}
+
+//returns a free target with that description, creating it if there is none
+FBO* FBOPool::acquire(const sRenderTargetDesc& desc)
+{
+	assert(desc.width && desc.height);
+	for (sEntry& entry : entries)
+		if (!entry.in_use && entry.desc == desc)
+		{
+			entry.in_use = true;
+			entry.last_used_frame = frame;
+			return entry.fbo;
+		}
+
+	//the format and type only describe the (empty) data, the internal format is the one stored
+	FBO* fbo = new FBO();
+	fbo->create(desc.width, desc.height, desc.num_textures, GL_RGBA, GL_UNSIGNED_BYTE, desc.depth, desc.internal_formats);
+
+	sEntry entry;
+	entry.desc = desc;
+	entry.fbo = fbo;
+	entry.in_use = true;
+	entry.last_used_frame = frame;
+	entries.push_back(entry);
+	return fbo;
+}
+
+//the content of the target is not valid after releasing it, other pass can take it
+void FBOPool::release(FBO* fbo)
+{
+	for (sEntry& entry : entries)
+		if (entry.fbo == fbo)
+		{
+			assert(entry.in_use && "target released twice");
+			entry.in_use = false;
+			return;
+		}
+	assert(0 && "target not from this pool");
+}
+
+void FBOPool::newFrame()
+{
+	frame++;
+	for (int i = (int)entries.size() - 1; i >= 0; --i)
+	{
+		sEntry& entry = entries[i];
+		if (entry.in_use || frame - entry.last_used_frame <= max_unused_frames)
+			continue;
+		delete entry.fbo;
+		entries.erase(entries.begin() + i);
+	}
+}
+
+void FBOPool::trim()
+{
+	for (int i = (int)entries.size() - 1; i >= 0; --i)
+	{
+		if (entries[i].in_use)
+			continue;
+		delete entries[i].fbo;
+		entries.erase(entries.begin() + i);
+	}
+}
+
+void FBOPool::clear()
+{
+	for (sEntry& entry : entries)
+		delete entry.fbo;
+	entries.clear();
+}
+
+//approximated, the driver may pad the formats (RGB8 is usually stored as RGBA8)
+int FBOPool::getBytesPerPixel(int internal_format)
+{
+	switch (internal_format)
+	{
+		case GL_R8: return 1;
+		case GL_RG8: case GL_R16F: case GL_R16: return 2;
+		case GL_RGBA16F: case GL_RGBA16: case GL_RG32F: return 8;
+		case GL_RGB16F: return 8;
+		case GL_RGBA32F: case GL_RGB32F: return 16;
+		default: return 4; //RGB8, RGBA8, SRGB8_ALPHA8, RGB10_A2, R11F_G11F_B10F, R32F, RG16F...
+	}
+}
+
+size_t FBOPool::getVRAMSize(const sRenderTargetDesc& desc)
+{
+	size_t bytes_per_pixel = desc.depth ? 4 : 0;
+	for (int i = 0; i < desc.num_textures; ++i)
+		bytes_per_pixel += getBytesPerPixel(desc.internal_formats[i]);
+	return bytes_per_pixel * desc.width * desc.height;
+}
+
+size_t FBOPool::getVRAMSize()
+{
+	size_t total = 0;
+	for (sEntry& entry : entries)
+		total += getVRAMSize(entry.desc);
+	return total;
+}
+
+void FBOPool::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	ImGui::Text("Render targets: %d, VRAM: %.2f MB", (int)entries.size(), getVRAMSize() / (1024.0f * 1024.0f));
+	for (sEntry& entry : entries)
+		ImGui::Text(" %dx%d, %d textures%s: %.2f MB%s", entry.desc.width, entry.desc.height, entry.desc.num_textures, entry.desc.depth ? " + depth" : "",
+			getVRAMSize(entry.desc) / (1024.0f * 1024.0f), entry.in_use ? " (in use)" : "");
+#endif
+}
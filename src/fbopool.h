@@ -0,0 +1,59 @@
+#ifndef FBOPOOL_H
+#define FBOPOOL_H
+
+#include "includes.h"
+#include <vector>
+
+class FBO;
+
+//what a pass needs from a render target, targets with the same description are interchangeable
+struct sRenderTargetDesc
+{
+	int width;
+	int height;
+	int num_textures;
+	int internal_formats[4];	//one per color texture
+	bool depth;	//with a depth texture
+
+	sRenderTargetDesc();
+	sRenderTargetDesc(int width, int height, int num_textures, const int* internal_formats, bool depth = true);
+	bool operator==(const sRenderTargetDesc& other) const;
+};
+
+//FBOPool
+//keeps the render targets of the passes so they are not created every frame
+//a pass acquires a target, renders and reads it, and releases it, so passes that dont overlap share the same memory
+//targets that are not requested for some frames (like the ones with the old size after a resize) are deleted
+
+class FBOPool {
+public:
+	struct sEntry
+	{
+		sRenderTargetDesc desc;
+		FBO* fbo;
+		bool in_use;
+		long last_used_frame;
+	};
+
+	std::vector<sEntry> entries;
+	long frame;
+	int max_unused_frames;
+
+	FBOPool();
+	~FBOPool();
+
+	FBO* acquire(const sRenderTargetDesc& desc);
+	void release(FBO* fbo);
+
+	void newFrame(); //deletes the targets not used recently
+	void trim(); //deletes all the targets not in use
+	void clear();
+
+	size_t getVRAMSize(); //bytes used by all the targets of the pool
+	static size_t getVRAMSize(const sRenderTargetDesc& desc);
+	static int getBytesPerPixel(int internal_format);
+
+	void renderInMenu();
+};
+
+#endif
@@ -0,0 +1,176 @@
+#include "framegraph.h"
+#include "fbo.h"
+#include "gpuprofiler.h"
+#include "cpuprofiler.h"
+#include <cassert>
+#include <algorithm>
+
+FrameGraph::FrameGraph(FBOPool* pool)
+{
+	assert(pool);
+	this->pool = pool;
+	invalidate_dead_targets = true;
+}
+
+void FrameGraph::clear()
+{
+	//targets still taken if the previous frame didnt execute
+	for (sResource& resource : resources)
+		if (resource.fbo)
+			pool->release(resource.fbo);
+	resources.clear();
+	passes.clear();
+}
+
+int FrameGraph::createTarget(const char* name, const sRenderTargetDesc& desc)
+{
+	sResource resource;
+	resource.name = name;
+	resource.transient = true;
+	resource.output = false;
+	resource.desc = desc;
+	resource.fbo = NULL;
+	resource.refcount = 0;
+	resource.first_pass = resource.last_pass = -1;
+	resources.push_back(resource);
+	return (int)resources.size() - 1;
+}
+
+int FrameGraph::importResource(const char* name)
+{
+	int index = createTarget(name, sRenderTargetDesc());
+	resources[index].transient = false;
+	return index;
+}
+
+void FrameGraph::markOutput(int resource)
+{
+	assert(!resources[resource].transient && "transient targets are released at the end of the frame");
+	resources[resource].output = true;
+}
+
+int FrameGraph::addPass(const char* name, std::function<void()> execute)
+{
+	sPass pass;
+	pass.name = name;
+	pass.execute = execute;
+	pass.refcount = 0;
+	pass.culled = false;
+	passes.push_back(pass);
+	return (int)passes.size() - 1;
+}
+
+void FrameGraph::read(int pass, int resource)
+{
+	passes[pass].reads.push_back(resource);
+}
+
+void FrameGraph::write(int pass, int resource)
+{
+	passes[pass].writes.push_back(resource);
+}
+
+void FrameGraph::compile()
+{
+	//every resource is needed by the passes reading it (and the outputs by the next frames)
+	for (sResource& resource : resources)
+	{
+		resource.refcount = resource.output ? 1 : 0;
+		resource.first_pass = resource.last_pass = -1;
+	}
+	for (sPass& pass : passes)
+	{
+		pass.refcount = (int)pass.writes.size();
+		pass.culled = false;
+		for (int r : pass.reads)
+			resources[r].refcount++;
+	}
+
+	//remove the writers of the resources nobody reads, that can leave unread the resources those passes were reading
+	std::vector<int> unused;
+	for (int i = 0; i < resources.size(); ++i)
+		if (resources[i].refcount == 0)
+			unused.push_back(i);
+
+	while (unused.size())
+	{
+		int r = unused.back();
+		unused.pop_back();
+		for (sPass& pass : passes)
+		{
+			if (pass.culled || std::find(pass.writes.begin(), pass.writes.end(), r) == pass.writes.end())
+				continue;
+			if (--pass.refcount > 0)
+				continue;
+			pass.culled = true;
+			for (int read : pass.reads)
+				if (--resources[read].refcount == 0)
+					unused.push_back(read);
+		}
+	}
+
+	//lifetime of every resource among the passes that are executed
+	for (int i = 0; i < passes.size(); ++i)
+	{
+		sPass& pass = passes[i];
+		if (pass.culled)
+			continue;
+		for (int k = 0; k < 2; ++k)
+			for (int r : (k == 0 ? pass.reads : pass.writes))
+			{
+				sResource& resource = resources[r];
+				if (resource.first_pass == -1)
+					resource.first_pass = i;
+				resource.last_pass = i;
+			}
+	}
+}
+
+void FrameGraph::execute()
+{
+	for (int i = 0; i < passes.size(); ++i)
+	{
+		sPass& pass = passes[i];
+		if (pass.culled)
+			continue;
+
+		//targets are taken just before their first use
+		for (sResource& resource : resources)
+			if (resource.transient && resource.first_pass == i)
+				resource.fbo = pool->acquire(resource.desc);
+
+		{
+			GPUZone gpu_zone(pass.name);
+			CPUZone cpu_zone(CPUProfiler::intern(pass.name));
+			pass.execute();
+		}
+
+		//and given back after the last one, so a later pass can reuse the memory
+		for (sResource& resource : resources)
+			if (resource.transient && resource.last_pass == i && resource.fbo)
+			{
+				if (invalidate_dead_targets)
+					resource.fbo->invalidateContents();
+				pool->release(resource.fbo);
+				resource.fbo = NULL;
+			}
+	}
+}
+
+FBO* FrameGraph::getTarget(int resource)
+{
+	assert(resources[resource].fbo && "the target is not alive in this pass");
+	return resources[resource].fbo;
+}
+
+void FrameGraph::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	ImGui::Checkbox("Invalidate dead targets", &invalidate_dead_targets);
+	for (sPass& pass : passes)
+		ImGui::Text("%s%s", pass.name.c_str(), pass.culled ? " (culled)" : "");
+	for (sResource& resource : resources)
+		if (resource.transient)
+			ImGui::Text("%s: passes %d to %d", resource.name.c_str(), resource.first_pass, resource.last_pass);
+#endif
+}
@@ -0,0 +1,67 @@
+#ifndef FRAMEGRAPH_H
+#define FRAMEGRAPH_H
+
+#include "includes.h"
+#include "fbopool.h"
+#include <vector>
+#include <string>
+#include <functional>
+
+class FBO;
+
+//FrameGraph
+//the frame is described every frame as a list of passes that declare which resources they read and write
+//compile() removes the passes whose results nobody uses and finds when every transient target is alive,
+//execute() runs the rest in order taking the transient targets from the pool only while they are alive,
+//so a target with the same size and formats as one that already died reuses its FBO instead of creating another,
+//and the content of every target is discarded after its last use
+
+class FrameGraph {
+public:
+	struct sResource
+	{
+		std::string name;
+		bool transient;	//render target from the pool, otherwise it lives outside the graph (backbuffer, shadow maps, ...)
+		bool output;	//used after the frame, the passes that write it are never removed
+		sRenderTargetDesc desc;
+		FBO* fbo;	//only while alive
+		int refcount;	//passes alive reading it
+		int first_pass;
+		int last_pass;
+	};
+
+	struct sPass
+	{
+		std::string name;
+		std::function<void()> execute;
+		std::vector<int> reads;
+		std::vector<int> writes;
+		int refcount;	//resources written that somebody uses
+		bool culled;
+	};
+
+	std::vector<sResource> resources;
+	std::vector<sPass> passes;
+	FBOPool* pool;
+	bool invalidate_dead_targets;	//glInvalidateFramebuffer once a target is not going to be read again
+
+	FrameGraph(FBOPool* pool);
+
+	//building, the resources and passes are indices valid until clear
+	void clear();
+	int createTarget(const char* name, const sRenderTargetDesc& desc);
+	int importResource(const char* name);
+	void markOutput(int resource);
+	int addPass(const char* name, std::function<void()> execute);	//passes are executed in the order they are added
+	void read(int pass, int resource);
+	void write(int pass, int resource);
+
+	void compile();
+	void execute();
+
+	FBO* getTarget(int resource);	//only inside the passes that use it
+
+	void renderInMenu();
+};
+
+#endif
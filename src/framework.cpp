@@ -1,10 +1,46 @@
 #include "framework.h"
 
-#include "includes.h"
+//SKIP_GL builds the math without SDL and OpenGL (for the benchmarks)
+#ifndef SKIP_GL
+	#include "includes.h"
+#else
+	#define TRUE 1
+	#define FALSE 0
+#endif
 #include <cassert>
+#include <cstring>
+#include <iostream>
 #include <cmath> //for sqrt (square root) function
 #include <math.h> //atan2
 
+#ifdef FRAMEWORK_SSE
+	#include <immintrin.h>
+	//GCC and clang only enable FMA with -mfma, MSVC has no __FMA__ but /arch:AVX2 implies it
+	#if defined(__FMA__) || (defined(_MSC_VER) && defined(__AVX2__))
+		#define FRAMEWORK_FMA
+	#endif
+
+//a * b + c, fused when the compiler targets FMA
+inline __m128 madd(__m128 a, __m128 b, __m128 c)
+{
+#ifdef FRAMEWORK_FMA
+	return _mm_fmadd_ps(a, b, c);
+#else
+	return _mm_add_ps(_mm_mul_ps(a, b), c);
+#endif
+}
+#endif
+
+#ifdef FRAMEWORK_AVX
+inline __m256 madd(__m256 a, __m256 b, __m256 c)
+{
+#ifdef FRAMEWORK_FMA
+	return _mm256_fmadd_ps(a, b, c);
+#else
+	return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+#endif
+}
+#endif
 
 #define M_PI_2 1.57079632679489661923
 
@@ -68,23 +104,25 @@ Vector2 operator - (const Vector2& a, const Vector2& b) { return Vector2(a.x - b
 
 // **************************************
 
+//in float, the double is only the return type
 double Vector3::length() 
 {
-	return sqrt(x*x + y*y + z*z);
+	return sqrtf(x*x + y*y + z*z);
 }
 
 double Vector3::length() const
 {
-	return sqrt(x*x + y*y + z*z);
+	return sqrtf(x*x + y*y + z*z);
 }
 
 Vector3& Vector3::normalize()
 {
-	double len = length();
+	float len = sqrtf(x*x + y*y + z*z);
 	assert(len > 0.00000000001 && "Cannot normalize a vector with module 0");
-	x = (float)(x / len);
-	y = (float)(y / len);
-	z = (float)(z / len);
+	float inv_len = 1.0f / len;
+	x *= inv_len;
+	y *= inv_len;
+	z *= inv_len;
 	return *this;
 }
 
@@ -190,14 +228,18 @@ Matrix44::Matrix44(const float* v)
 
 void Matrix44::set()
 {
+#ifndef SKIP_GL
 	glMatrixMode( GL_MODELVIEW );
 	glMultMatrixf(m);
+#endif
 }
 
 void Matrix44::load()
 {
+#ifndef SKIP_GL
 	glMatrixMode( GL_MODELVIEW );
 	glLoadMatrixf(m);
+#endif
 }
 
 void Matrix44::clear()
@@ -221,7 +263,8 @@ void Matrix44::transpose()
 
 Vector3 Matrix44::rotateVector(const Vector3& v) const
 {
-	return (*this * Vector4(v,0.0)).xyz;
+	Vector4 r = *this * Vector4(v, 0.0);
+	return Vector3(r.x, r.y, r.z);
 }
 
 void Matrix44::translateGlobal(float x, float y, float z)
@@ -422,10 +465,41 @@ Vector3 Matrix44::project(const Vector3& v)
 
 
 //Multiply a matrix by another and returns the result
+//every row of the result is the sum of the rows of matrix weighted by the same row of this one
 Matrix44 Matrix44::operator*(const Matrix44& matrix) const
 {
 	Matrix44 ret;
 
+#if defined(FRAMEWORK_AVX)
+	//two rows at a time, the rows of matrix are repeated in both halves
+	__m256 b0 = _mm256_broadcast_ps((const __m128*)matrix.M[0]);
+	__m256 b1 = _mm256_broadcast_ps((const __m128*)matrix.M[1]);
+	__m256 b2 = _mm256_broadcast_ps((const __m128*)matrix.M[2]);
+	__m256 b3 = _mm256_broadcast_ps((const __m128*)matrix.M[3]);
+	for (int i = 0; i < 4; i += 2)
+	{
+		__m256 a = _mm256_loadu_ps(M[i]);
+		__m256 r = _mm256_mul_ps(_mm256_shuffle_ps(a, a, 0x00), b0);
+		r = madd(_mm256_shuffle_ps(a, a, 0x55), b1, r);
+		r = madd(_mm256_shuffle_ps(a, a, 0xAA), b2, r);
+		r = madd(_mm256_shuffle_ps(a, a, 0xFF), b3, r);
+		_mm256_storeu_ps(ret.M[i], r);
+	}
+#elif defined(FRAMEWORK_SSE)
+	__m128 b0 = _mm_loadu_ps(matrix.M[0]);
+	__m128 b1 = _mm_loadu_ps(matrix.M[1]);
+	__m128 b2 = _mm_loadu_ps(matrix.M[2]);
+	__m128 b3 = _mm_loadu_ps(matrix.M[3]);
+	for (int i = 0; i < 4; ++i)
+	{
+		__m128 a = _mm_loadu_ps(M[i]);
+		__m128 r = _mm_mul_ps(_mm_shuffle_ps(a, a, 0x00), b0);
+		r = madd(_mm_shuffle_ps(a, a, 0x55), b1, r);
+		r = madd(_mm_shuffle_ps(a, a, 0xAA), b2, r);
+		r = madd(_mm_shuffle_ps(a, a, 0xFF), b3, r);
+		_mm_storeu_ps(ret.M[i], r);
+	}
+#else
 	unsigned int i,j,k;
 	for (i=0;i<4;i++) 	
 	{
@@ -436,6 +510,7 @@ Matrix44 Matrix44::operator*(const Matrix44& matrix) const
 				ret.M[i][j] += M[i][k] * matrix.M[k][j];
 		}
 	}
+#endif
 
 	return ret;
 }
@@ -449,6 +524,27 @@ Vector3 operator * (const Matrix44& matrix, const Vector3& v)
    return Vector3(x,y,z);
 }
 
+void transformPoints(const Matrix44& matrix, const Vector3* points, Vector3* result, int num)
+{
+#ifdef FRAMEWORK_SSE
+	__m128 x = _mm_loadu_ps(matrix.m);
+	__m128 y = _mm_loadu_ps(matrix.m + 4);
+	__m128 z = _mm_loadu_ps(matrix.m + 8);
+	__m128 t = _mm_loadu_ps(matrix.m + 12);
+	for (int i = 0; i < num; ++i)
+	{
+		const Vector3& p = points[i];
+		__m128 r = madd(x, _mm_set1_ps(p.x), madd(y, _mm_set1_ps(p.y), madd(z, _mm_set1_ps(p.z), t)));
+		//only 3 floats are written, a store of 4 would overwrite the next point
+		_mm_storel_pi((__m64*)result[i].v, r);
+		_mm_store_ss(&result[i].z, _mm_movehl_ps(r, r));
+	}
+#else
+	for (int i = 0; i < num; ++i)
+		result[i] = matrix * points[i];
+#endif
+}
+
 //Multiplies a vector by a matrix and returns the new vector
 Vector4 operator * (const Matrix44& matrix, const Vector4& v)
 {
@@ -534,6 +630,90 @@ void Matrix44::setFrontAndOrthonormalize(Vector3 front)
 
 bool Matrix44::inverse()
 {
+#ifdef FRAMEWORK_SSE
+	//cofactors with Cramer's rule, from the Intel paper "Streaming SIMD Extensions - Inverse of 4x4 Matrix"
+	__m128 minor0, minor1, minor2, minor3;
+	__m128 row0, row1, row2, row3;
+	__m128 det, tmp1;
+
+	//transposed, with the halves of row1 and row3 swapped
+	tmp1 = _mm_loadh_pi(_mm_loadl_pi(_mm_setzero_ps(), (const __m64*)(m)), (const __m64*)(m + 4));
+	row1 = _mm_loadh_pi(_mm_loadl_pi(_mm_setzero_ps(), (const __m64*)(m + 8)), (const __m64*)(m + 12));
+	row0 = _mm_shuffle_ps(tmp1, row1, 0x88);
+	row1 = _mm_shuffle_ps(row1, tmp1, 0xDD);
+	tmp1 = _mm_loadh_pi(_mm_loadl_pi(tmp1, (const __m64*)(m + 2)), (const __m64*)(m + 6));
+	row3 = _mm_loadh_pi(_mm_loadl_pi(_mm_setzero_ps(), (const __m64*)(m + 10)), (const __m64*)(m + 14));
+	row2 = _mm_shuffle_ps(tmp1, row3, 0x88);
+	row3 = _mm_shuffle_ps(row3, tmp1, 0xDD);
+
+	tmp1 = _mm_mul_ps(row2, row3);
+	tmp1 = _mm_shuffle_ps(tmp1, tmp1, 0xB1);
+	minor0 = _mm_mul_ps(row1, tmp1);
+	minor1 = _mm_mul_ps(row0, tmp1);
+	tmp1 = _mm_shuffle_ps(tmp1, tmp1, 0x4E);
+	minor0 = _mm_sub_ps(_mm_mul_ps(row1, tmp1), minor0);
+	minor1 = _mm_sub_ps(_mm_mul_ps(row0, tmp1), minor1);
+	minor1 = _mm_shuffle_ps(minor1, minor1, 0x4E);
+
+	tmp1 = _mm_mul_ps(row1, row2);
+	tmp1 = _mm_shuffle_ps(tmp1, tmp1, 0xB1);
+	minor0 = _mm_add_ps(_mm_mul_ps(row3, tmp1), minor0);
+	minor3 = _mm_mul_ps(row0, tmp1);
+	tmp1 = _mm_shuffle_ps(tmp1, tmp1, 0x4E);
+	minor0 = _mm_sub_ps(minor0, _mm_mul_ps(row3, tmp1));
+	minor3 = _mm_sub_ps(_mm_mul_ps(row0, tmp1), minor3);
+	minor3 = _mm_shuffle_ps(minor3, minor3, 0x4E);
+
+	tmp1 = _mm_mul_ps(_mm_shuffle_ps(row1, row1, 0x4E), row3);
+	tmp1 = _mm_shuffle_ps(tmp1, tmp1, 0xB1);
+	row2 = _mm_shuffle_ps(row2, row2, 0x4E);
+	minor0 = _mm_add_ps(_mm_mul_ps(row2, tmp1), minor0);
+	minor2 = _mm_mul_ps(row0, tmp1);
+	tmp1 = _mm_shuffle_ps(tmp1, tmp1, 0x4E);
+	minor0 = _mm_sub_ps(minor0, _mm_mul_ps(row2, tmp1));
+	minor2 = _mm_sub_ps(_mm_mul_ps(row0, tmp1), minor2);
+	minor2 = _mm_shuffle_ps(minor2, minor2, 0x4E);
+
+	tmp1 = _mm_mul_ps(row0, row1);
+	tmp1 = _mm_shuffle_ps(tmp1, tmp1, 0xB1);
+	minor2 = _mm_add_ps(_mm_mul_ps(row3, tmp1), minor2);
+	minor3 = _mm_sub_ps(_mm_mul_ps(row2, tmp1), minor3);
+	tmp1 = _mm_shuffle_ps(tmp1, tmp1, 0x4E);
+	minor2 = _mm_sub_ps(_mm_mul_ps(row3, tmp1), minor2);
+	minor3 = _mm_sub_ps(minor3, _mm_mul_ps(row2, tmp1));
+
+	tmp1 = _mm_mul_ps(row0, row3);
+	tmp1 = _mm_shuffle_ps(tmp1, tmp1, 0xB1);
+	minor1 = _mm_sub_ps(minor1, _mm_mul_ps(row2, tmp1));
+	minor2 = _mm_add_ps(_mm_mul_ps(row1, tmp1), minor2);
+	tmp1 = _mm_shuffle_ps(tmp1, tmp1, 0x4E);
+	minor1 = _mm_add_ps(_mm_mul_ps(row2, tmp1), minor1);
+	minor2 = _mm_sub_ps(minor2, _mm_mul_ps(row1, tmp1));
+
+	tmp1 = _mm_mul_ps(row0, row2);
+	tmp1 = _mm_shuffle_ps(tmp1, tmp1, 0xB1);
+	minor1 = _mm_add_ps(_mm_mul_ps(row3, tmp1), minor1);
+	minor3 = _mm_sub_ps(minor3, _mm_mul_ps(row1, tmp1));
+	tmp1 = _mm_shuffle_ps(tmp1, tmp1, 0x4E);
+	minor1 = _mm_sub_ps(minor1, _mm_mul_ps(row3, tmp1));
+	minor3 = _mm_add_ps(_mm_mul_ps(row1, tmp1), minor3);
+
+	det = _mm_mul_ps(row0, minor0);
+	det = _mm_add_ps(_mm_shuffle_ps(det, det, 0x4E), det);
+	det = _mm_add_ss(_mm_shuffle_ps(det, det, 0xB1), det);
+
+	//singular, the matrix is left as it was like in the scalar version
+	float determinant = _mm_cvtss_f32(det);
+	if (fabsf(determinant) < 1e-30f || !std::isfinite(determinant))
+		return false;
+
+	det = _mm_set1_ps(1.0f / determinant);
+	_mm_storeu_ps(m, _mm_mul_ps(det, minor0));
+	_mm_storeu_ps(m + 4, _mm_mul_ps(det, minor1));
+	_mm_storeu_ps(m + 8, _mm_mul_ps(det, minor2));
+	_mm_storeu_ps(m + 12, _mm_mul_ps(det, minor3));
+	return true;
+#else
    unsigned int i, j, k, swap;
    float t;
    Matrix44 temp, final;
@@ -603,16 +783,21 @@ bool Matrix44::inverse()
    *this = final;
 
    return true;
+#endif
 }
 
 void Matrix44::multGL()
 {
+#ifndef SKIP_GL
 	glMultMatrixf(m);
+#endif
 }
 
 void Matrix44::loadGL()
 {
+#ifndef SKIP_GL
 	glLoadMatrixf(m);
+#endif
 }
 
 
@@ -1240,7 +1425,7 @@ Vector3 normalize(Vector3 n)
 
 int planeBoxOverlap( const Vector4& plane, const Vector3& center, const Vector3& halfsize )
 {
-	Vector3 n = plane.xyz;
+	Vector3 n(plane.x, plane.y, plane.z);
 	float d = plane.w;
 	float radius = abs(halfsize.x * n[0]) + abs(halfsize.y * n[1]) + abs(halfsize.z * n[2]);
 	float distance = dot(n, center) + d;
@@ -1253,28 +1438,34 @@ int planeBoxOverlap( const Vector4& plane, const Vector3& center, const Vector3&
 
 float signedDistanceToPlane( const Vector4& plane, const Vector3& point )
 {
-	return dot(plane.xyz, point) + plane.w;
+	return plane.x * point.x + plane.y * point.y + plane.z * point.z + plane.w;
 }
 
-const Vector3 corners[] = { {1,1,1},  {1,1,-1},  {1,-1,1},  {1,-1,-1},  {-1,1,1},  {-1,1,-1},  {-1,-1,1},  {-1,-1,-1} };
-
+//same bounds as transforming the 8 corners without transforming them (Arvo): the center is transformed
+//and every axis of the matrix adds its absolute value times the halfsize along it
 BoundingBox transformBoundingBox(const Matrix44 m, const BoundingBox& box)
 {
-	Vector3 box_min(10000000.0f,1000000.0f, 1000000.0f);
-	Vector3 box_max(-10000000.0f, -1000000.0f, -1000000.0f);
-
-	for (int i = 0; i < 8; ++i)
-	{
-		Vector3 corner = corners[i];
-		corner = box.halfsize * corner;
-		corner = corner + box.center;
-		corner = m * corner;
-		box_min.setMin(corner);
-		box_max.setMax(corner);
-	}
-
-	Vector3 halfsize = (box_max - box_min) * 0.5;
-	return BoundingBox(box_max - halfsize, halfsize );
+#ifdef FRAMEWORK_SSE
+	__m128 sign = _mm_set1_ps(-0.0f);
+	__m128 x = _mm_loadu_ps(m.m);
+	__m128 y = _mm_loadu_ps(m.m + 4);
+	__m128 z = _mm_loadu_ps(m.m + 8);
+	__m128 t = _mm_loadu_ps(m.m + 12);
+	__m128 center = madd(x, _mm_set1_ps(box.center.x), madd(y, _mm_set1_ps(box.center.y), madd(z, _mm_set1_ps(box.center.z), t)));
+	__m128 halfsize = _mm_mul_ps(_mm_andnot_ps(sign, x), _mm_set1_ps(box.halfsize.x));
+	halfsize = madd(_mm_andnot_ps(sign, y), _mm_set1_ps(box.halfsize.y), halfsize);
+	halfsize = madd(_mm_andnot_ps(sign, z), _mm_set1_ps(box.halfsize.z), halfsize);
+	float c[4], h[4];
+	_mm_storeu_ps(c, center);
+	_mm_storeu_ps(h, halfsize);
+	return BoundingBox(Vector3(c[0], c[1], c[2]), Vector3(h[0], h[1], h[2]));
+#else
+	const Vector3& h = box.halfsize;
+	Vector3 halfsize(fabsf(m.m[0]) * h.x + fabsf(m.m[4]) * h.y + fabsf(m.m[8]) * h.z,
+		fabsf(m.m[1]) * h.x + fabsf(m.m[5]) * h.y + fabsf(m.m[9]) * h.z,
+		fabsf(m.m[2]) * h.x + fabsf(m.m[6]) * h.y + fabsf(m.m[10]) * h.z);
+	return BoundingBox(m * box.center, halfsize);
+#endif
 }
 
 //from https://github.com/erich666/GraphicsGems/blob/master/gems/RayBox.c
@@ -14,6 +14,17 @@
 #define DEG2RAD 0.0174532925
 #define RAD2DEG 57.295779513
 
+//SIMD version of the hot math functions, chosen at compile time from the target of the compiler:
+//AVX (/arch:AVX, -mavx) and SSE (any x64 build, /arch:SSE2, -msse2), otherwise or with FRAMEWORK_NO_SIMD the scalar code
+#ifndef FRAMEWORK_NO_SIMD
+	#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+		#define FRAMEWORK_SSE
+	#endif
+	#if defined(FRAMEWORK_SSE) && defined(__AVX__)
+		#define FRAMEWORK_AVX
+	#endif
+#endif
+
 //more standard type definition
 typedef char int8;
 typedef unsigned char uint8;
@@ -21,6 +32,7 @@ typedef unsigned short uint16;
 typedef short int16;
 typedef int int32;
 typedef unsigned int uint32;
+typedef unsigned long long uint64;
 
 inline float clamp(float v, float a, float b) { return v < a ? a : (v > b ? b : v); }
 inline float lerp(float a, float b, float v ) { return a*(1.0f-v) + b*v; }
@@ -139,7 +151,9 @@ public:
 	{
 		struct { float x,y,z,w; };
 		float v[4];
-		struct { Vector3 xyz; };
+#ifdef _MSC_VER
+		struct { Vector3 xyz; }; //GCC and clang do not allow members with constructors here
+#endif
 	};
 
 	Vector4() { x = y = z = w = 0.0; }
@@ -267,6 +281,7 @@ class Matrix44
 //Matrix44 operator * ( const Matrix44& a, const Matrix44& b );
 Vector3 operator * (const Matrix44& matrix, const Vector3& v);
 Vector4 operator * (const Matrix44& matrix, const Vector4& v); 
+void transformPoints(const Matrix44& matrix, const Vector3* points, Vector3* result, int num); //result can be the same array
 
 
 class Quaternion
@@ -0,0 +1,221 @@
+#include "glstate.h"
+
+int GLState::applied = 0;
+int GLState::skipped = 0;
+int GLState::last_frame_applied = 0;
+int GLState::last_frame_skipped = 0;
+
+//-1 means unknown, so the next call is always applied
+static int blend_enabled = -1;
+static int depth_test_enabled = -1;
+static int cull_face_enabled = -1;
+static int depth_mask = -1;
+static GLenum blend_src = 0;
+static GLenum blend_dst = 0;
+static GLenum blend_equation = 0;
+static GLenum depth_func = 0;
+static GLenum cull_face = 0;
+static int current_program = -1;
+static int current_framebuffer = -1;
+static int current_vertex_array = -1;
+static int active_slot = -1;
+
+//texture bound to every slot for the 2D, cubemap and 3D targets
+static int bound_textures[GLSTATE_MAX_TEXTURE_SLOTS][3];
+
+static int* getCapState(GLenum cap)
+{
+	switch (cap)
+	{
+		case GL_BLEND: return &blend_enabled;
+		case GL_DEPTH_TEST: return &depth_test_enabled;
+		case GL_CULL_FACE: return &cull_face_enabled;
+	}
+	return NULL;
+}
+
+static int getTargetIndex(GLenum target)
+{
+	switch (target)
+	{
+		case GL_TEXTURE_2D: return 0;
+		case GL_TEXTURE_CUBE_MAP: return 1;
+		case GL_TEXTURE_3D: return 2;
+	}
+	return -1;
+}
+
+void GLState::setEnabled(GLenum cap, bool enabled)
+{
+	int* state = getCapState(cap);
+	if (state && *state == (int)enabled)
+	{
+		skipped++;
+		return;
+	}
+	if (state)
+		*state = enabled;
+	if (enabled)
+		glEnable(cap);
+	else
+		glDisable(cap);
+	applied++;
+}
+
+void GLState::enable(GLenum cap)
+{
+	setEnabled(cap, true);
+}
+
+void GLState::disable(GLenum cap)
+{
+	setEnabled(cap, false);
+}
+
+void GLState::blendFunc(GLenum sfactor, GLenum dfactor)
+{
+	if (blend_src == sfactor && blend_dst == dfactor)
+	{
+		skipped++;
+		return;
+	}
+	blend_src = sfactor;
+	blend_dst = dfactor;
+	glBlendFunc(sfactor, dfactor);
+	applied++;
+}
+
+void GLState::blendEquation(GLenum mode)
+{
+	if (blend_equation == mode)
+	{
+		skipped++;
+		return;
+	}
+	blend_equation = mode;
+	glBlendEquation(mode);
+	applied++;
+}
+
+void GLState::depthFunc(GLenum func)
+{
+	if (depth_func == func)
+	{
+		skipped++;
+		return;
+	}
+	depth_func = func;
+	glDepthFunc(func);
+	applied++;
+}
+
+void GLState::depthMask(bool enabled)
+{
+	if (depth_mask == (int)enabled)
+	{
+		skipped++;
+		return;
+	}
+	depth_mask = enabled;
+	glDepthMask(enabled);
+	applied++;
+}
+
+void GLState::cullFace(GLenum mode)
+{
+	if (cull_face == mode)
+	{
+		skipped++;
+		return;
+	}
+	cull_face = mode;
+	glCullFace(mode);
+	applied++;
+}
+
+void GLState::useProgram(GLuint program)
+{
+	if (current_program == (int)program)
+	{
+		skipped++;
+		return;
+	}
+	current_program = program;
+	glUseProgram(program);
+	applied++;
+}
+
+void GLState::bindFramebuffer(GLuint fbo)
+{
+	if (current_framebuffer == (int)fbo)
+	{
+		skipped++;
+		return;
+	}
+	current_framebuffer = fbo;
+	glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, fbo);
+	applied++;
+}
+
+void GLState::bindVertexArray(GLuint vao)
+{
+	if (current_vertex_array == (int)vao)
+	{
+		skipped++;
+		return;
+	}
+	current_vertex_array = vao;
+	glBindVertexArray(vao);
+	applied++;
+}
+
+void GLState::activeTexture(int slot)
+{
+	if (active_slot == slot)
+	{
+		skipped++;
+		return;
+	}
+	active_slot = slot;
+	glActiveTexture(GL_TEXTURE0 + slot);
+	applied++;
+}
+
+void GLState::bindTexture(GLenum target, GLuint texture)
+{
+	int target_index = getTargetIndex(target);
+	int* state = (active_slot >= 0 && active_slot < GLSTATE_MAX_TEXTURE_SLOTS && target_index != -1) ? &bound_textures[active_slot][target_index] : NULL;
+	if (state && *state == (int)texture)
+	{
+		skipped++;
+		return;
+	}
+	if (state)
+		*state = texture;
+	glBindTexture(target, texture);
+	applied++;
+}
+
+void GLState::bindTexture(int slot, GLenum target, GLuint texture)
+{
+	activeTexture(slot);
+	bindTexture(target, texture);
+}
+
+void GLState::invalidate()
+{
+	blend_enabled = depth_test_enabled = cull_face_enabled = depth_mask = -1;
+	blend_src = blend_dst = blend_equation = depth_func = cull_face = 0;
+	current_program = current_framebuffer = current_vertex_array = active_slot = -1;
+	for (int i = 0; i < GLSTATE_MAX_TEXTURE_SLOTS; ++i)
+		for (int j = 0; j < 3; ++j)
+			bound_textures[i][j] = -1;
+}
+
+void GLState::newFrame()
+{
+	last_frame_applied = applied;
+	last_frame_skipped = skipped;
+	applied = skipped = 0;
+	invalidate();
+}
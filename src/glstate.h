@@ -0,0 +1,43 @@
+#ifndef GLSTATE_H
+#define GLSTATE_H
+
+#include "includes.h"
+
+#define GLSTATE_MAX_TEXTURE_SLOTS 16
+
+//GLState
+//keeps a copy of the GL state so the calls that wouldnt change anything are skipped
+//every change of blending, depth, culling, program, framebuffer, vertex array or texture binding should go through here,
+//code that touches GL directly (like ImGui) must be followed by invalidate()
+
+class GLState {
+public:
+	//changes of this frame
+	static int applied;
+	static int skipped;
+
+	//changes of the previous frame (to show them)
+	static int last_frame_applied;
+	static int last_frame_skipped;
+
+	static void enable(GLenum cap);
+	static void disable(GLenum cap);
+	static void setEnabled(GLenum cap, bool enabled);
+	static void blendFunc(GLenum sfactor, GLenum dfactor);
+	static void blendEquation(GLenum mode);
+	static void depthFunc(GLenum func);
+	static void depthMask(bool enabled);
+	static void cullFace(GLenum mode);
+
+	static void useProgram(GLuint program);
+	static void bindFramebuffer(GLuint fbo);
+	static void bindVertexArray(GLuint vao);
+	static void activeTexture(int slot);
+	static void bindTexture(GLenum target, GLuint texture); //to the active slot
+	static void bindTexture(int slot, GLenum target, GLuint texture);
+
+	static void invalidate(); //forget the stored state, next calls will be applied
+	static void newFrame(); //stores the counters of the last frame and resets them
+};
+
+#endif
@@ -7,6 +7,7 @@
 #include "texture.h"
 #include "material.h"
 #include "prefab.h"
+#include "cpuprofiler.h"
 
 #include <iostream>
 
@@ -333,6 +334,7 @@ GTR::Node* parseGLTFNode(cgltf_node* node, GTR::Node* scenenode = NULL)
 
 GTR::Prefab* loadGLTF(const char* filename)
 {
+	CPUZone zone("loadGLTF");
 	std::cout << "loading gltf... " << filename << std::endl;
 	cgltf_options options;
 	memset(&options, 0, sizeof(cgltf_options));
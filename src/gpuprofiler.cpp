@@ -0,0 +1,205 @@
+#include "gpuprofiler.h"
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+
+bool GPUProfiler::enabled = true;
+bool GPUProfiler::debug_groups = true;
+GPUProfiler::sFrame GPUProfiler::frames[GPUPROFILER_FRAMES];
+int GPUProfiler::current = 0;
+long GPUProfiler::frame = 0;
+std::vector<GPUProfiler::sStats> GPUProfiler::stats;
+int GPUProfiler::skipped_frames = 0;
+
+//the options are taken at the start of the frame, so begin and end always match
+static bool frame_enabled = false;
+static bool frame_debug_groups = false;
+static std::vector<int> open_zones;	//index of the zone in the frame, -1 if it was not measured
+
+static bool hasDebugGroups()
+{
+#ifdef __APPLE__
+	return false;
+#else
+	#ifdef USE_GLEW
+	return glPushDebugGroup != NULL; //GL 4.3 or KHR_debug
+	#else
+	return true;
+	#endif
+#endif
+}
+
+float GPUProfiler::sStats::getAverage()
+{
+	if (!num_samples)
+		return 0.0f;
+	float total = 0.0f;
+	for (int i = 0; i < num_samples; ++i)
+		total += samples[i];
+	return total / num_samples;
+}
+
+//p from 0 to 1
+float GPUProfiler::sStats::getPercentile(float p)
+{
+	if (!num_samples)
+		return 0.0f;
+	float sorted[GPUPROFILER_HISTORY];
+	memcpy(sorted, samples, sizeof(float) * num_samples);
+	std::sort(sorted, sorted + num_samples);
+	int index = std::min((int)(p * num_samples), num_samples - 1);
+	return sorted[index];
+}
+
+void GPUProfiler::begin(const char* name)
+{
+	if (frame_debug_groups)
+		glPushDebugGroup(GL_DEBUG_SOURCE_APPLICATION, 0, -1, name);
+
+	if (!frame_enabled)
+	{
+		open_zones.push_back(-1);
+		return;
+	}
+
+	sFrame& f = frames[current];
+	sZone zone;
+	strncpy(zone.name, name, GPUPROFILER_NAME - 1);
+	zone.name[GPUPROFILER_NAME - 1] = 0;
+	zone.depth = (int)open_zones.size();
+	for (int i = 0; i < 2; ++i)
+	{
+		if (f.free_queries.empty())
+		{
+			GLuint query;
+			glGenQueries(1, &query);
+			f.free_queries.push_back(query);
+		}
+		zone.queries[i] = f.free_queries.back();
+		f.free_queries.pop_back();
+	}
+
+	//timestamps instead of GL_TIME_ELAPSED because elapsed queries cannot be nested
+	glQueryCounter(zone.queries[0], GL_TIMESTAMP);
+	open_zones.push_back((int)f.zones.size());
+	f.zones.push_back(zone);
+}
+
+void GPUProfiler::end()
+{
+	assert(open_zones.size() && "GPUProfiler::end without begin");
+	int index = open_zones.back();
+	open_zones.pop_back();
+	if (index != -1)
+		glQueryCounter(frames[current].zones[index].queries[1], GL_TIMESTAMP);
+
+	if (frame_debug_groups)
+		glPopDebugGroup();
+}
+
+void GPUProfiler::newFrame()
+{
+	assert(open_zones.empty() && "GPU zones not ended in the previous frame");
+	open_zones.clear();
+
+	//the oldest frame of the ring is reused, its results should be ready by now
+	current = (current + 1) % GPUPROFILER_FRAMES;
+	sFrame& f = frames[current];
+	readFrame(f);
+	for (sZone& zone : f.zones)
+	{
+		f.free_queries.push_back(zone.queries[0]);
+		f.free_queries.push_back(zone.queries[1]);
+	}
+	f.zones.clear();
+
+	//forget the zones that stopped appearing (lights removed, passes disabled...)
+	for (int i = (int)stats.size() - 1; i >= 0; --i)
+		if (frame - stats[i].last_frame > GPUPROFILER_HISTORY)
+			stats.erase(stats.begin() + i);
+
+	frame++;
+	frame_enabled = enabled;
+	frame_debug_groups = debug_groups && hasDebugGroups();
+}
+
+void GPUProfiler::clear()
+{
+	for (sFrame& f : frames)
+	{
+		for (sZone& zone : f.zones)
+			glDeleteQueries(2, zone.queries);
+		if (f.free_queries.size())
+			glDeleteQueries((GLsizei)f.free_queries.size(), &f.free_queries[0]);
+		f.zones.clear();
+		f.free_queries.clear();
+	}
+	stats.clear();
+}
+
+void GPUProfiler::readFrame(sFrame& f)
+{
+	if (f.zones.empty())
+		return;
+
+	//if the GPU is still behind, the frame is lost instead of waiting for it
+	for (sZone& zone : f.zones)
+	{
+		GLint available = 0;
+		glGetQueryObjectiv(zone.queries[1], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available)
+		{
+			skipped_frames++;
+			return;
+		}
+	}
+
+	for (int i = 0; i < f.zones.size(); ++i)
+	{
+		sZone& zone = f.zones[i];
+		GLuint64 start = 0, end = 0;
+		glGetQueryObjectui64v(zone.queries[0], GL_QUERY_RESULT, &start);
+		glGetQueryObjectui64v(zone.queries[1], GL_QUERY_RESULT, &end);
+
+		sStats& s = getStats(zone.name, zone.depth, i);
+		s.last = (end - start) / 1000000.0f;
+		s.samples[s.next] = s.last;
+		s.next = (s.next + 1) % GPUPROFILER_HISTORY;
+		s.num_samples = std::min(s.num_samples + 1, GPUPROFILER_HISTORY);
+		s.last_frame = frame;
+	}
+}
+
+//order is the position of the zone in the frame, new zones are inserted there so the list follows the frame
+GPUProfiler::sStats& GPUProfiler::getStats(const char* name, int depth, int order)
+{
+	for (sStats& s : stats)
+		if (s.depth == depth && s.name == name)
+			return s;
+
+	sStats s;
+	s.name = name;
+	s.depth = depth;
+	s.num_samples = 0;
+	s.next = 0;
+	s.last = 0.0f;
+	s.last_frame = frame;
+	order = std::min(order, (int)stats.size());
+	stats.insert(stats.begin() + order, s);
+	return stats[order];
+}
+
+void GPUProfiler::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	ImGui::Checkbox("Enabled", &enabled);
+	ImGui::Checkbox("Debug groups", &debug_groups);
+	ImGui::Text("Frames not ready in time: %d", skipped_frames);
+	ImGui::Text("%-28s %7s %7s %7s %7s", "zone (ms)", "last", "avg", "p50", "p95");
+	for (sStats& s : stats)
+	{
+		std::string name = std::string(s.depth * 2, ' ') + s.name;
+		ImGui::Text("%-28s %7.3f %7.3f %7.3f %7.3f", name.c_str(), s.last, s.getAverage(), s.getPercentile(0.5f), s.getPercentile(0.95f));
+	}
+#endif
+}
@@ -0,0 +1,75 @@
+#ifndef GPUPROFILER_H
+#define GPUPROFILER_H
+
+#include "includes.h"
+#include <vector>
+#include <string>
+
+#define GPUPROFILER_FRAMES 4	//frames the GPU can be behind before its timings are read
+#define GPUPROFILER_HISTORY 128	//samples kept per zone for the averages
+#define GPUPROFILER_NAME 64	//longer names are cut
+
+//GPUProfiler
+//measures how long the GPU spends in every zone (pass, light...) with timestamp queries
+//the queries of a frame are read some frames later, only if they are already available, so the CPU never waits
+//every zone is also a KHR_debug group, so captures in RenderDoc, Nsight... show the same structure
+
+class GPUProfiler {
+public:
+	struct sZone
+	{
+		char name[GPUPROFILER_NAME];	//copied, so beginning a zone does not allocate
+		int depth;	//zones inside other zones
+		GLuint queries[2];	//begin and end
+	};
+
+	struct sFrame
+	{
+		std::vector<sZone> zones;
+		std::vector<GLuint> free_queries;
+		int open;	//zones begun and not ended
+	};
+
+	struct sStats
+	{
+		std::string name;
+		int depth;
+		float samples[GPUPROFILER_HISTORY];	//ms
+		int num_samples;
+		int next;
+		float last;
+		long last_frame;	//zones not seen for a while are removed
+
+		float getAverage();
+		float getPercentile(float p);
+	};
+
+	static bool enabled;
+	static bool debug_groups;	//KHR_debug push and pop
+	static sFrame frames[GPUPROFILER_FRAMES];
+	static int current;
+	static long frame;
+	static std::vector<sStats> stats;	//in the order they appear in the frame
+	static int skipped_frames;	//results not ready in time
+
+	static void begin(const char* name);
+	static void end();
+	static void newFrame();	//call before rendering anything of the frame
+	static void clear();
+
+	static void renderInMenu();
+
+private:
+	static void readFrame(sFrame& f);
+	static sStats& getStats(const char* name, int depth, int order);
+};
+
+//begins a zone that ends with the scope
+struct GPUZone
+{
+	GPUZone(const char* name) { GPUProfiler::begin(name); }
+	GPUZone(const std::string& name) { GPUProfiler::begin(name.c_str()); }
+	~GPUZone() { GPUProfiler::end(); }
+};
+
+#endif
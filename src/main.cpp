@@ -15,6 +15,9 @@
 #include "utils.h"
 #include "input.h"
 #include "application.h"
+#include "gpuprofiler.h"
+#include "cpuprofiler.h"
+#include "benchmark.h"
 
 #include <iostream> //to output
 
@@ -25,7 +28,7 @@ SDL_GLContext glcontext;
 
 // *********************************
 //create a window using SDL
-SDL_Window* createWindow(const char* caption, int width, int height, bool fullscreen = false)
+SDL_Window* createWindow(const char* caption, int width, int height, bool fullscreen = false, bool hidden = false)
 {
     int multisample = 8;
     bool retina = false; //change this to use a retina display
@@ -45,14 +48,16 @@ SDL_Window* createWindow(const char* caption, int width, int height, bool fullsc
 #endif
     
 	//antialiasing (disable this lines if it goes too slow)
-	SDL_GL_SetAttribute(SDL_GL_MULTISAMPLEBUFFERS, 1);
-	SDL_GL_SetAttribute(SDL_GL_MULTISAMPLESAMPLES, multisample ); //increase to have smoother polygons
+	//not when hidden: nothing is shown and software drivers without a GPU may not support 8 samples
+	SDL_GL_SetAttribute(SDL_GL_MULTISAMPLEBUFFERS, hidden ? 0 : 1);
+	SDL_GL_SetAttribute(SDL_GL_MULTISAMPLESAMPLES, hidden ? 0 : multisample ); //increase to have smoother polygons
 
 	// Initialize the joystick subsystem
 	SDL_InitSubSystem(SDL_INIT_JOYSTICK);
 
 	//create the window
-	SDL_Window * sdl_window = SDL_CreateWindow(caption, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, width, height, SDL_WINDOW_OPENGL|SDL_WINDOW_RESIZABLE|
+	SDL_Window * sdl_window = SDL_CreateWindow(caption, SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, width, height, SDL_WINDOW_OPENGL|
+                                          (hidden ? SDL_WINDOW_HIDDEN : SDL_WINDOW_RESIZABLE) |
                                           (retina ? SDL_WINDOW_ALLOW_HIGHDPI:0) |
                                           (fullscreen?SDL_WINDOW_FULLSCREEN_DESKTOP:0) );
 	if(!sdl_window)
@@ -63,6 +68,11 @@ SDL_Window* createWindow(const char* caption, int width, int height, bool fullsc
   
 	// Create an OpenGL context associated with the window.
 	glcontext = SDL_GL_CreateContext(sdl_window);
+	if (!glcontext)
+	{
+		fprintf(stderr, "OpenGL context creation error: %s\n", SDL_GetError());
+		exit(-1);
+	}
 
 	//in case of exit, call SDL_Quit()
 	atexit(SDL_Quit);
@@ -108,6 +118,8 @@ void renderDebug(SDL_Window* window, Application * app)
 	}
 
 	// Rendering
+	GPUZone gpu_zone("imgui");
+	CPUZone cpu_zone("imgui");
 	ImGui::EndFrame();
 	ImGui::Render();
 	glViewport(0, 0, (int)io.DisplaySize.x, (int)io.DisplaySize.y);
@@ -120,12 +132,16 @@ void mainLoop(SDL_Window* window)
 {
 	SDL_Event sdlEvent;
 
-	long start_time = SDL_GetTicks();
-	long now = start_time;
+	//the performance counter has sub-millisecond resolution, SDL_GetTicks only milliseconds
+	Uint64 frequency = SDL_GetPerformanceFrequency();
+	Uint64 start_time = SDL_GetPerformanceCounter();
+	Uint64 now = start_time;
 	long frames_this_second = 0;
 
 	while (!app->must_exit)
 	{
+		CPUProfiler::newFrame();
+
 		//render frame
 		app->render();
 		if (app->render_gui)
@@ -179,11 +195,13 @@ void mainLoop(SDL_Window* window)
 		Input::update();
 
 		//compute delta time
-		long last_time = now;
-		now = SDL_GetTicks();
-		double elapsed_time = (now - last_time) * 0.001; //0.001 converts from milliseconds to seconds
+		Uint64 last_time = now;
+		now = SDL_GetPerformanceCounter();
+		double elapsed_time = (now - last_time) / (double)frequency;
+		if (app->fixed_timestep)
+			elapsed_time = app->fixed_timestep;
 		double last_time_seconds = app->time;
-		app->time = float(now * 0.001);
+		app->time = app->fixed_timestep ? float(app->time + elapsed_time) : float((now - start_time) / (double)frequency);
 		app->elapsed_time = elapsed_time;
 		app->frame++;
 		frames_this_second++;
@@ -209,17 +227,33 @@ int main(int argc, char **argv)
 {
 	std::cout << "Initiating app..." << std::endl;
 
-	//prepare SDL
-	SDL_Init(SDL_INIT_EVERYTHING);
+	sBenchmarkOptions benchmark_options;
+	if (!benchmark_options.parse(argc, argv))
+	{
+		std::cout << "Usage: " << argv[0] << " [--benchmark [--headless] [--scene name] [--frames n] [--warmup n] [--size WxH] [--camera-path file] [--output file.json|file.csv]] [--scene default|test|stress]"
+			<< " [--objects n] [--point-lights n] [--spot-lights n] [--random] [--spacing d] [--depth n] [--animated] [--seed n] [--prefab file]" << std::endl;
+		return 1;
+	}
+
+	//prepare SDL, without a display the offscreen driver creates the GL context with EGL
+	if (benchmark_options.headless)
+	{
+		SDL_setenv("SDL_VIDEODRIVER", "offscreen", 1);
+		SDL_Init(SDL_INIT_VIDEO);
+	}
+	else
+		SDL_Init(SDL_INIT_EVERYTHING);
 
 	bool fullscreen = false; //change this to go fullscreen
 	Vector2 size(1024,768);
 
 	if(fullscreen)
 		size = getDesktopSize(0);
+	if (benchmark_options.enabled)
+		size.set(benchmark_options.width, benchmark_options.height);
 
 	//create the application window (WINDOW_WIDTH and WINDOW_HEIGHT are two macros defined in includes.h)
-	SDL_Window*window = createWindow("TJE", (int)size.x, (int)size.y, fullscreen );
+	SDL_Window*window = createWindow("TJE", (int)size.x, (int)size.y, fullscreen, benchmark_options.headless );
 	if (!window)
 		return 0;
 	int window_width, window_height;
@@ -244,10 +278,19 @@ int main(int argc, char **argv)
 	Input::init(window);
 
 	//launch the application (app is a global variable)
-	app = new Application(window_width, window_height, window);
+	app = new Application(window_width, window_height, window, benchmark_options.scene.c_str());
 
 	//main loop, application gets inside here till user closes it
-	mainLoop(window);
+	int result = 0;
+	if (benchmark_options.enabled)
+	{
+		Benchmark benchmark(benchmark_options);
+		benchmark.run(app, window);
+		benchmark.printSummary();
+		result = benchmark.save() ? 0 : 1;
+	}
+	else
+		mainLoop(window);
 
 	//save state and free memory
 	// Cleanup
@@ -261,5 +304,5 @@ int main(int argc, char **argv)
 	SDL_DestroyWindow(window);
 	SDL_Quit();
 
-	return 0;
+	return result;
 }
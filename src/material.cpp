@@ -7,6 +7,7 @@
 using namespace GTR;
 
 std::map<std::string, Material*> Material::sMaterials;
+int Material::num_created = 0;
 
 Material* Material::Get(const char* name)
 {
@@ -23,7 +23,9 @@ namespace GTR {
 		//static manager to reuse materials
 		static std::map<std::string, Material*> sMaterials;
 		static Material* Get(const char* name);
+		static int num_created;
 		std::string name;
+		int index;	//sequential, used to sort the render calls by material without depending on the address
 		void registerMaterial(const char* name);
 
 		//parameters to control transparency
@@ -49,6 +51,7 @@ namespace GTR {
 								//ctors
 		Material() : alpha_mode(NO_ALPHA), alpha_cutoff(0.5), color(1, 1, 1, 1), two_sided(false), roughness_factor(1), metallic_factor(0) {
 			color_texture = emissive_texture = metallic_roughness_texture = occlusion_texture = normal_texture = NULL;
+			index = num_created++;
 		}
 		Material(Texture* texture) : Material() { color_texture = texture; }
 		virtual ~Material();
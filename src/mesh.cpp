@@ -4,6 +4,8 @@
 #include "shader.h"
 #include "includes.h"
 #include "framework.h"
+#include "glstate.h"
+#include "cpuprofiler.h"
 
 #include <cassert>
 #include <iostream>
@@ -22,6 +24,7 @@ bool Mesh::interleave_meshes = true;	//places the geometry in an interleaved arr
 std::map<std::string, Mesh*> Mesh::sMeshesLoaded;
 long Mesh::num_meshes_rendered = 0;
 long Mesh::num_triangles_rendered = 0;
+int Mesh::num_created = 0;
 
 #define FORMAT_ASE 1
 #define FORMAT_OBJ 2
@@ -30,8 +33,11 @@ long Mesh::num_triangles_rendered = 0;
 
 Mesh::Mesh()
 {
+	index = num_created++;
 	radius = 0;
-	vertices_vbo_id = uvs_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = bones_vbo_id = weights_vbo_id = 0;
+	vertices_vbo_id = uvs_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = bones_vbo_id = weights_vbo_id = uvs1_vbo_id = 0;
+	positions_vbo_id = 0;
+	vao_id = positions_vao_id = 0;
 	collision_model = NULL;
 	clear();
 }
@@ -63,9 +69,18 @@ void Mesh::clear()
 		glDeleteBuffersARB(1, &weights_vbo_id);
 	if (uvs1_vbo_id)
 		glDeleteBuffersARB(1, &uvs1_vbo_id);
+	if (positions_vbo_id)
+		glDeleteBuffersARB(1, &positions_vbo_id);
+	if (vao_id)
+		glDeleteVertexArrays(1, &vao_id);
+	if (positions_vao_id)
+		glDeleteVertexArrays(1, &positions_vao_id);
+	if (vao_id || positions_vao_id)
+		GLState::invalidate();
+	vao_id = positions_vao_id = 0;
 
 	//VBOs ids
-	vertices_vbo_id = uvs_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = weights_vbo_id = bones_vbo_id = uvs1_vbo_id = 0;
+	vertices_vbo_id = uvs_vbo_id = normals_vbo_id = colors_vbo_id = interleaved_vbo_id = indices_vbo_id = weights_vbo_id = bones_vbo_id = uvs1_vbo_id = positions_vbo_id = 0;
 
 	//buffers
 	vertices.clear();
@@ -222,7 +237,7 @@ void Mesh::enableBuffers(Shader* sh)
 
 }
 
-void Mesh::render(unsigned int primitive, int submesh_id, int num_instances)
+void Mesh::render(unsigned int primitive, int submesh_id, int num_instances, bool positions_only)
 {
 	Shader* shader = Shader::current;
 	if (!shader || !shader->compiled)
@@ -232,6 +247,17 @@ void Mesh::render(unsigned int primitive, int submesh_id, int num_instances)
 	}
 	assert((interleaved.size() || vertices.size()) && "No vertices in this mesh");
 
+	//meshes in VRAM only need to bind their VAO
+	if (vertices_vbo_id || interleaved_vbo_id)
+	{
+		bindVAO(positions_only);
+		drawCall(primitive, submesh_id, num_instances);
+		return;
+	}
+
+	//meshes in RAM bind every stream for this draw
+	GLState::bindVertexArray(0);
+
 	//bind buffers to attribute locations
 	enableBuffers(shader);
 
@@ -265,18 +291,12 @@ void Mesh::drawCall(unsigned int primitive, int submesh_id, int num_instances)
 		if (num_instances > 0)
 		{
 			assert(indices_vbo_id && "indices must be uploaded to the GPU");
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
-			glDrawElementsInstanced(primitive, size * 3, GL_UNSIGNED_INT, (void*)(start + sizeof(Vector3)), num_instances);
-			glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+			glDrawElementsInstanced(primitive, size * 3, GL_UNSIGNED_INT, (void*)(start * sizeof(Vector3)), num_instances);
 		}
 		else
 		{
-			if (indices_vbo_id)
-			{
-				glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
+			if (indices_vbo_id) //the index buffer is bound in the VAO
 				glDrawElements(primitive, size * 3, GL_UNSIGNED_INT, (void*)(start * sizeof(Vector3)));
-				glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-			}
 			else
 				glDrawElements(primitive, size * 3, GL_UNSIGNED_INT, (void*)(&indices[0] + start)); //no multiply, its a vector3u pointer)
 		}
@@ -304,10 +324,115 @@ void Mesh::disableBuffers(Shader* shader)
 	glBindBuffer(GL_ARRAY_BUFFER, 0);    //if crashes here, COMMENT THIS LINE ****************************
 }
 
+void Mesh::createVAO()
+{
+	assert((vertices_vbo_id || interleaved_vbo_id) && "mesh must be uploaded to VRAM");
+
+	int spacing = 0;
+	int offset_normal = 0;
+	int offset_uv = 0;
+
+	if (interleaved_vbo_id)
+	{
+		spacing = sizeof(tInterleaved);
+		offset_normal = sizeof(Vector3);
+		offset_uv = sizeof(Vector3) + sizeof(Vector3);
+	}
+
+	glGenVertexArrays(1, &vao_id);
+	GLState::bindVertexArray(vao_id);
+
+	glBindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id ? interleaved_vbo_id : vertices_vbo_id);
+	glEnableVertexAttribArray(VERTEX_ATTRIB);
+	glVertexAttribPointer(VERTEX_ATTRIB, 3, GL_FLOAT, GL_FALSE, spacing, 0);
+
+	if (normals_vbo_id || interleaved_vbo_id)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id ? interleaved_vbo_id : normals_vbo_id);
+		glEnableVertexAttribArray(NORMAL_ATTRIB);
+		glVertexAttribPointer(NORMAL_ATTRIB, 3, GL_FLOAT, GL_FALSE, spacing, (void*)offset_normal);
+	}
+
+	if (uvs_vbo_id || interleaved_vbo_id)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, interleaved_vbo_id ? interleaved_vbo_id : uvs_vbo_id);
+		glEnableVertexAttribArray(UV_ATTRIB);
+		glVertexAttribPointer(UV_ATTRIB, 2, GL_FLOAT, GL_FALSE, spacing, (void*)offset_uv);
+	}
+
+	if (uvs1_vbo_id)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, uvs1_vbo_id);
+		glEnableVertexAttribArray(UV1_ATTRIB);
+		glVertexAttribPointer(UV1_ATTRIB, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+	}
+
+	if (colors_vbo_id)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, colors_vbo_id);
+		glEnableVertexAttribArray(COLOR_ATTRIB);
+		glVertexAttribPointer(COLOR_ATTRIB, 4, GL_FLOAT, GL_FALSE, 0, NULL);
+	}
+
+	if (bones_vbo_id)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, bones_vbo_id);
+		glEnableVertexAttribArray(BONES_ATTRIB);
+		glVertexAttribPointer(BONES_ATTRIB, 4, GL_UNSIGNED_BYTE, GL_FALSE, 0, NULL);
+	}
+
+	if (weights_vbo_id)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, weights_vbo_id);
+		glEnableVertexAttribArray(WEIGHTS_ATTRIB);
+		glVertexAttribPointer(WEIGHTS_ATTRIB, 4, GL_FLOAT, GL_FALSE, 0, NULL);
+	}
+
+	//the element buffer binding is stored in the VAO
+	if (indices_vbo_id)
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
+
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void Mesh::createPositionsVAO()
+{
+	assert((vertices_vbo_id || interleaved_vbo_id) && "mesh must be uploaded to VRAM");
+
+	glGenVertexArrays(1, &positions_vao_id);
+	GLState::bindVertexArray(positions_vao_id);
+
+	//non interleaved meshes already have the positions in their own buffer
+	glBindBuffer(GL_ARRAY_BUFFER, positions_vbo_id ? positions_vbo_id : vertices_vbo_id);
+	glEnableVertexAttribArray(VERTEX_ATTRIB);
+	glVertexAttribPointer(VERTEX_ATTRIB, 3, GL_FLOAT, GL_FALSE, 0, 0);
+
+	if (indices_vbo_id)
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indices_vbo_id);
+
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+//creates the VAO the first time it is used
+void Mesh::bindVAO(bool positions_only)
+{
+	//interleaved meshes uploaded before having the positions buffer use the full stream
+	if (positions_only && (positions_vbo_id || !interleaved_vbo_id))
+	{
+		if (!positions_vao_id)
+			createPositionsVAO();
+		GLState::bindVertexArray(positions_vao_id);
+		return;
+	}
+	if (!vao_id)
+		createVAO();
+	GLState::bindVertexArray(vao_id);
+}
+
 GLuint instances_buffer_id = 0;
 
 //should be faster but in some system it is slower
-void Mesh::renderInstanced(unsigned int primitive, const Matrix44* instanced_models, int num_instances)
+void Mesh::renderInstanced(unsigned int primitive, const Matrix44* instanced_models, int num_instances, bool positions_only)
 {
 	if (!num_instances)
 		return;
@@ -315,15 +440,24 @@ void Mesh::renderInstanced(unsigned int primitive, const Matrix44* instanced_mod
 	Shader* shader = Shader::current;
 	assert(shader && "shader must be enabled");
 
+	if (!shader->has_instanced_model)
+	{
+		assert(0 && "shader must have attribute mat4 u_model (not a uniform)");
+		return; //this shader doesnt support instanced model
+	}
+
+	//the instanced attributes are set in the VAO of the mesh (or in the default one for meshes in RAM)
+	if (vertices_vbo_id || interleaved_vbo_id)
+		bindVAO(positions_only);
+	else
+		GLState::bindVertexArray(0);
+
 	if (instances_buffer_id == 0)
 		glGenBuffersARB(1, &instances_buffer_id);
 	glBindBufferARB(GL_ARRAY_BUFFER_ARB, instances_buffer_id);
 	glBufferDataARB(GL_ARRAY_BUFFER_ARB, num_instances * sizeof(Matrix44), instanced_models, GL_STREAM_DRAW_ARB);
 
-	int attribLocation = shader->getAttribLocation("u_model");
-	assert(attribLocation != -1 && "shader must have attribute mat4 u_model (not a uniform)");
-	if (attribLocation == -1)
-		return; //this shader doesnt support instanced model
+	int attribLocation = INSTANCED_MODEL_ATTRIB;
 
 	//mat4 count as 4 different attributes of vec4... (thanks opengl...)
 	for (int k = 0; k < 4; ++k)
@@ -336,7 +470,7 @@ void Mesh::renderInstanced(unsigned int primitive, const Matrix44* instanced_mod
 	}
 
 	//regular render
-	render(primitive, 0, num_instances);
+	render(primitive, -1, num_instances, positions_only);
 
 	//disable instanced attribs
 	for (int k = 0; k < 4; ++k)
@@ -349,6 +483,7 @@ void Mesh::renderInstanced(unsigned int primitive, const Matrix44* instanced_mod
 //super obsolete rendering method, do not use
 void Mesh::renderFixedPipeline(int primitive)
 {
+	GLState::bindVertexArray(0);
 	assert((vertices.size() || interleaved.size()) && "No vertices in this mesh");
 
 	int interleave_offset = interleaved.size() ? sizeof(tInterleaved) : 0;
@@ -443,6 +578,9 @@ void Mesh::uploadToVRAM()
 		exit(0);
 	}
 
+	//binding the index buffer would modify the VAO that is bound
+	GLState::bindVertexArray(0);
+
 	if (interleaved.size())
 	{
 		// Vertex,Normal,UV
@@ -450,6 +588,15 @@ void Mesh::uploadToVRAM()
 			glGenBuffersARB(1, &interleaved_vbo_id);
 		glBindBufferARB(GL_ARRAY_BUFFER_ARB, interleaved_vbo_id);
 		glBufferDataARB(GL_ARRAY_BUFFER_ARB, interleaved.size() * sizeof(tInterleaved), &interleaved[0], GL_STATIC_DRAW_ARB);
+
+		//Positions alone, depth only passes are limited by the vertex fetch
+		std::vector<Vector3> positions(interleaved.size());
+		for (size_t i = 0; i < interleaved.size(); ++i)
+			positions[i] = interleaved[i].vertex;
+		if (positions_vbo_id == 0)
+			glGenBuffersARB(1, &positions_vbo_id);
+		glBindBufferARB(GL_ARRAY_BUFFER_ARB, positions_vbo_id);
+		glBufferDataARB(GL_ARRAY_BUFFER_ARB, positions.size() * sizeof(Vector3), &positions[0], GL_STATIC_DRAW_ARB);
 	}
 	else
 	{
@@ -523,7 +670,14 @@ void Mesh::uploadToVRAM()
 	}
 	glBindBufferARB(GL_ELEMENT_ARRAY_BUFFER, 0);
 
-
+	//the streams may have changed, the VAOs will be created again in the next render
+	if (vao_id)
+		glDeleteVertexArrays(1, &vao_id);
+	if (positions_vao_id)
+		glDeleteVertexArrays(1, &positions_vao_id);
+	if (vao_id || positions_vao_id)
+		GLState::invalidate();
+	vao_id = positions_vao_id = 0;
 
 	checkGLErrors();
 
@@ -1441,6 +1595,69 @@ void Mesh::createGrid(float dist)
 	}
 }
 
+void Mesh::createSphere(int slices, int stacks)
+{
+	vertices.clear();
+	normals.clear();
+	uvs.clear();
+	colors.clear();
+
+	for (int i = 0; i < stacks; ++i)
+		for (int j = 0; j < slices; ++j)
+		{
+			//four corners of the patch, counter clockwise seen from outside
+			Vector3 p[4];
+			for (int k = 0; k < 4; ++k)
+			{
+				float theta = (i + (k == 1 || k == 2 ? 1 : 0)) * PI / stacks;
+				float phi = (j + (k >= 2 ? 1 : 0)) * 2 * PI / slices;
+				p[k].set(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi));
+			}
+			int indices[6] = { 0, 3, 2, 0, 2, 1 };
+			for (int k = 0; k < 6; ++k)
+			{
+				vertices.push_back(p[indices[k]]);
+				normals.push_back(p[indices[k]]);
+			}
+		}
+
+	box.center.set(0, 0, 0);
+	box.halfsize.set(1, 1, 1);
+	radius = 1;
+}
+
+void Mesh::createCone(int slices)
+{
+	vertices.clear();
+	normals.clear();
+	uvs.clear();
+	colors.clear();
+
+	Vector3 apex(0, 0, 0);
+	Vector3 center(0, 0, 1);
+	for (int j = 0; j < slices; ++j)
+	{
+		float phi = j * 2 * PI / slices;
+		float next_phi = (j + 1) * 2 * PI / slices;
+		Vector3 a(cos(phi), sin(phi), 1);
+		Vector3 b(cos(next_phi), sin(next_phi), 1);
+
+		//side
+		vertices.push_back(apex);
+		vertices.push_back(b);
+		vertices.push_back(a);
+
+		//base
+		vertices.push_back(center);
+		vertices.push_back(a);
+		vertices.push_back(b);
+	}
+
+	box.center.set(0, 0, 0.5);
+	box.halfsize.set(1, 1, 0.5);
+	radius = (float)box.halfsize.length();
+}
+
 void Mesh::updateBoundingBox()
 {
 	if (vertices.size())
@@ -1523,6 +1740,7 @@ Mesh* Mesh::Get(const char* filename)
 	if (it != sMeshesLoaded.end())
 		return it->second;
 
+	CPUZone zone("Mesh::Get");
 	Mesh* m = new Mesh();
 	std::string name = filename;
 
@@ -11,6 +11,18 @@ class Shader; //for binding
 class Image; //for displace
 class Skeleton; //for skinned meshes
 
+//fixed attribute locations, bound in every shader before linking so all of them share the same vertex layout
+enum eVertexAttribute {
+	VERTEX_ATTRIB = 0,
+	NORMAL_ATTRIB = 1,
+	UV_ATTRIB = 2,
+	COLOR_ATTRIB = 3,
+	UV1_ATTRIB = 4,
+	BONES_ATTRIB = 5,
+	WEIGHTS_ATTRIB = 6,
+	INSTANCED_MODEL_ATTRIB = 8 //mat4, uses 8 to 11
+};
+
 //version from 11/5/2020
 #define MESH_BIN_VERSION 11 //this is used to regenerate bins if the format changes
 
@@ -36,8 +48,10 @@ public:
 	static bool auto_upload_to_vram; //loaded meshes will be stored in the VRAM
 	static long num_meshes_rendered;
 	static long num_triangles_rendered;
+	static int num_created;
 
 	std::string name;
+	int index; //sequential, used to sort the render calls by mesh without depending on the address
 
 	std::vector<sSubmeshInfo> submeshes; //contains info about every submesh
 
@@ -80,13 +94,18 @@ public:
 	unsigned int weights_vbo_id;
 	unsigned int uvs1_vbo_id;
 
+	unsigned int positions_vbo_id; //tightly packed copy of the positions of interleaved meshes, for depth only passes
+	unsigned int vao_id; //all the streams uploaded to VRAM bound to the fixed attribute locations
+	unsigned int positions_vao_id; //only the positions (and the indices)
+
 	Mesh();
 	~Mesh();
 
 	void clear();
 
-	void render( unsigned int primitive, int submesh_id = -1, int num_instances = 0 );
-	void renderInstanced(unsigned int primitive, const Matrix44* instanced_models, int number);
+	//positions_only reads 12 bytes per vertex instead of the full stream, for shaders that only use a_vertex
+	void render( unsigned int primitive, int submesh_id = -1, int num_instances = 0, bool positions_only = false );
+	void renderInstanced(unsigned int primitive, const Matrix44* instanced_models, int number, bool positions_only = false);
 	void renderBounding( const Matrix44& model, bool world_bounding = true );
 	void renderFixedPipeline(int primitive); //sloooooooow
 	//void renderAnimated(unsigned int primitive, Skeleton *sk);
@@ -94,6 +113,9 @@ public:
 	void enableBuffers(Shader* shader);
 	void drawCall(unsigned int primitive, int submesh_id, int num_instances);
 	void disableBuffers(Shader* shader);
+	void createVAO(); //once the buffers are in VRAM
+	void createPositionsVAO();
+	void bindVAO(bool positions_only);
 
 	bool readBin(const char* filename);
 	bool writeBin(const char* filename);
@@ -120,6 +142,8 @@ public:
 	void createPyramid();
 	void createWireBox();
 	void createGrid(float dist);
+	void createSphere(int slices = 16, int stacks = 8); //unit sphere centered in the origin
+	void createCone(int slices = 16); //apex in the origin, base of radius 1 at z = 1
 	void displace(Image* heightmap, float altitude);
 	static Mesh* getQuad(); //get global quad
 
@@ -7,23 +7,636 @@
 #include "prefab.h"
 #include "material.h"
 #include "utils.h"
+#include "ubo.h"
+#include "glstate.h"
+#include "fbopool.h"
+#include "gpuprofiler.h"
+#include "cpuprofiler.h"
 
 #include "application.h"
 #include "scene.h"
 
+#include <algorithm>
+
 class Application;
 
 using namespace GTR;
 
+//uniform handles, valid for every shader
+static UniformID u_model_id("u_model");
+static UniformID u_color_id("u_color");
+static UniformID u_texture_id("u_texture");
+static UniformID u_emissive_texture_id("u_emissive_texture");
+static UniformID u_color_texture_id("u_color_texture");
+static UniformID u_normal_texture_id("u_normal_texture");
+static UniformID u_metal_roughness_texture_id("u_metal_roughness_texture");
+static UniformID u_depth_texture_id("u_depth_texture");
+static UniformID u_ambient_light_id("u_ambient_light");
+static UniformID u_single_pass_id("u_single_pass");
+static UniformID u_light_index_id("u_light_index");
+static UniformID u_light_volume_id("u_light_volume");
+static UniformID u_tiled_id("u_tiled");
+static UniformID u_tiles_texture_id("u_tiles_texture");
+static UniformID u_tile_size_id("u_tile_size");
+static UniformID u_iRes_id("u_iRes");
+static UniformID u_camera_nearfar_id("u_camera_nearfar");
+static UniformID u_gbuffer_compact_id("u_gbuffer_compact");
+static UniformID u_shadow_atlas_id("u_shadow_atlas");
+static UniformID u_point_shadows_id[MAX_POINT_SHADOWS] = { UniformID("u_point_shadows[0]"), UniformID("u_point_shadows[1]"), UniformID("u_point_shadows[2]"), UniformID("u_point_shadows[3]") };
+static UniformID u_face_mask_id("u_face_mask");
+static UniformID u_face_viewprojection_id("u_face_viewprojection");
+static UniformID u_light_position_id("u_light_position");
+static UniformID u_light_maxdist_id("u_light_maxdist");
+static UniformID u_exposure_id("u_exposure");
+
+Renderer::Renderer()
+{
+	shadow = false;
+	deferred = false;
+	show_GBuffers = false;
+	use_instancing = true;
+	fbo = NULL;
+	compact_gbuffer = true;
+	fbo_compact = false;
+	render_targets = new FBOPool();
+	use_deferred = true;
+
+	exposure = 1.0f;
+	auto_exposure = true;
+	exposure_key = 0.18f;
+	exposure_adaptation = 2.0f;
+	average_luminance = 0.18f;
+	luminance_texture = NULL;
+	luminance_fbo = NULL;
+	for (int i = 0; i < 3; ++i)
+	{
+		luminance_pbos[i] = 0;
+		luminance_fences[i] = 0;
+	}
+	luminance_write = 0;
+
+	camera_ubo = new UBO();
+	camera_ubo->create(sizeof(sCameraData), UBO_CAMERA);
+	bound_light_group = -1;
+	material_ubo = new UBO();
+	material_ubo->create(sizeof(sMaterialData), UBO_MATERIAL);
+	current_material = NULL;
+
+	shadow_atlas = NULL;
+	shadow_atlas_size = 4096;
+	min_shadow_tile = 256;
+	max_shadow_tile = 1024;
+	point_shadow_size = 512;
+	for (int i = 0; i < MAX_POINT_SHADOWS; ++i)
+	{
+		point_shadow_maps[i] = NULL;
+		point_shadow_fbos[i] = NULL;
+	}
+	max_single_pass_lights = MAX_LIGHTS;
+
+	tiled_deferred = true;
+	use_light_volumes = true;
+	tile_size = 32;
+	tiles_texture = NULL;
+	cache_shadows = true;
+
+	loadShaders();
+}
+
+void Renderer::loadShaders()
+{
+	light_shader = Shader::Get("light");
+	light_instanced_shader = Shader::Get("light_instanced");
+	flat_shader = Shader::Get("flat");
+	shadow_shader = Shader::Get("shadow");
+	shadow_instanced_shader = Shader::Get("shadow_instanced");
+	shadow_masked_shader = Shader::Get("shadow_masked");
+	shadow_masked_instanced_shader = Shader::Get("shadow_masked_instanced");
+	deferred_shader = Shader::Get("deferred");
+	deferred_instanced_shader = Shader::Get("deferred_instanced");
+	deferred_volume_shader = Shader::Get("deferred_volume");
+	deferred_pospo_shader = Shader::Get("deferred_pospo");
+	depth_shader = Shader::Get("depth");
+	point_shadow_shader = Shader::Get("point_shadow");
+	point_shadow_masked_shader = Shader::Get("point_shadow_masked");
+	luminance_shader = Shader::Get("luminance");
+	tonemap_shader = Shader::Get("tonemap");
+}
+
+//the shader reads the tile of each light using its shadow_rect, and the cubemap of point lights using its slot
+//every sampler gets a texture of its type even if no light uses it
+void Renderer::bindShadowMaps(Shader* shader, int slot)
+{
+	shader->setUniform(u_shadow_atlas_id, shadow_atlas ? shadow_atlas->depth_texture : Texture::getWhiteTexture(), slot);
+
+	createPointShadowMaps();
+	for (int i = 0; i < MAX_POINT_SHADOWS; ++i)
+		shader->setUniform(u_point_shadows_id[i], point_shadow_maps[i], slot + 1 + i);
+}
+
+void Renderer::createPointShadowMaps()
+{
+	if (point_shadow_maps[0])
+		return;
+
+	for (int i = 0; i < MAX_POINT_SHADOWS; ++i)
+	{
+		point_shadow_maps[i] = new Texture();
+		point_shadow_maps[i]->createCubemap(point_shadow_size, point_shadow_size, NULL, GL_DEPTH_COMPONENT, GL_FLOAT, false, GL_DEPTH_COMPONENT24);
+		point_shadow_fbos[i] = new FBO();
+		point_shadow_fbos[i]->setDepthCubemap(point_shadow_maps[i]);
+	}
+}
+
+//a free square of the atlas
+struct sShadowTile
+{
+	int x, y, size;
+};
+
+//gives a tile to every light that casts shadows, the bigger the light on screen the bigger the tile
+//tiles are powers of two, so placing them from biggest to smallest by splitting free squares in four never leaves gaps
+void Renderer::allocateShadowAtlas(Camera* camera)
+{
+	if (!shadow_atlas)
+	{
+		shadow_atlas = new FBO();
+		shadow_atlas->setDepthOnly(shadow_atlas_size, shadow_atlas_size);
+	}
+
+	std::vector< std::pair<int, Light*> > requests;
+	std::vector< std::pair<float, Light*> > point_requests;
+	for (Light* light : Scene::getInstance()->lightEntities)
+	{
+		light->shadow_rect.set(0, 0, 0, 0);
+		int previous_slot = light->point_shadow_slot;
+		light->point_shadow_slot = -1;
+		if (!light->visible)
+			continue;
+
+		int size = 0;
+		if (light->light_type == lightType::DIRECTIONAL)
+			size = shadow_atlas_size / 2;
+		else if (light->light_type == lightType::SPOT || light->light_type == lightType::POINT_LIGHT)
+		{
+			Vector3 light_pos = light->model.getTranslation();
+			if (!camera->testSphereInFrustum(light_pos, light->maxDist))
+				continue;
+
+			//fraction of the screen height covered by the range of the light
+			float dist = (float)camera->eye.distance(light_pos);
+			float coverage = 1.0f;
+			if (dist > light->maxDist)
+				coverage = clamp(light->maxDist / (dist * (float)tan(camera->fov * 0.5f * DEG2RAD)), 0.0f, 1.0f);
+
+			//point lights dont use the atlas, the biggest ones on screen get a cubemap
+			if (light->light_type == lightType::POINT_LIGHT)
+			{
+				light->point_shadow_slot = previous_slot;
+				point_requests.push_back(std::make_pair(coverage, light));
+				continue;
+			}
+
+			size = min_shadow_tile;
+			while (size < max_shadow_tile && size < coverage * max_shadow_tile)
+				size *= 2;
+		}
+		if (size)
+			requests.push_back(std::make_pair(size, light));
+	}
+
+	//same order every frame so the tiles (and the cached shadows) dont move
+	std::stable_sort(requests.begin(), requests.end(), [](const std::pair<int, Light*>& a, const std::pair<int, Light*>& b) { return a.first > b.first; });
+
+	std::vector<sShadowTile> free_tiles;
+	free_tiles.push_back({ 0, 0, shadow_atlas_size });
+
+	for (auto& request : requests)
+	{
+		//if the atlas is full the light gets smaller tiles or no shadow at all
+		int found = -1;
+		int size = request.first;
+		while (size >= min_shadow_tile)
+		{
+			//the smallest free square where it fits
+			for (int i = 0; i < free_tiles.size(); ++i)
+				if (free_tiles[i].size >= size && (found == -1 || free_tiles[i].size < free_tiles[found].size))
+					found = i;
+			if (found != -1)
+				break;
+			size /= 2;
+		}
+		if (found == -1)
+			continue;
+
+		sShadowTile tile = free_tiles[found];
+		free_tiles.erase(free_tiles.begin() + found);
+		while (tile.size > size)
+		{
+			int half = tile.size / 2;
+			free_tiles.push_back({ tile.x + half, tile.y, half });
+			free_tiles.push_back({ tile.x, tile.y + half, half });
+			free_tiles.push_back({ tile.x + half, tile.y + half, half });
+			tile.size = half;
+		}
+		request.second->shadow_rect.set((float)tile.x, (float)tile.y, (float)size, (float)size);
+	}
+
+	std::stable_sort(point_requests.begin(), point_requests.end(), [](const std::pair<float, Light*>& a, const std::pair<float, Light*>& b) { return a.first > b.first; });
+	if (point_requests.size() > MAX_POINT_SHADOWS)
+	{
+		for (size_t i = MAX_POINT_SHADOWS; i < point_requests.size(); ++i)
+			point_requests[i].second->point_shadow_slot = -1;
+		point_requests.resize(MAX_POINT_SHADOWS);
+	}
+
+	//the lights keep the cubemap of the previous frame when possible, so their cached shadow is still valid
+	Light* slots[MAX_POINT_SHADOWS] = {};
+	for (auto& request : point_requests)
+	{
+		int slot = request.second->point_shadow_slot;
+		if (slot >= 0 && slot < MAX_POINT_SHADOWS && !slots[slot])
+			slots[slot] = request.second;
+		else
+			request.second->point_shadow_slot = -1;
+	}
+	for (auto& request : point_requests)
+	{
+		if (request.second->point_shadow_slot != -1)
+			continue;
+		for (int i = 0; i < MAX_POINT_SHADOWS; ++i)
+			if (!slots[i])
+			{
+				slots[i] = request.second;
+				request.second->point_shadow_slot = i;
+				break;
+			}
+	}
+	createPointShadowMaps();
+}
+
+//renders the distance to the light of the casters in its cubemap, the six faces at once
+//every mesh tells the geometry shader in which faces it is visible, so it is only replicated where needed
+void Renderer::renderPointShadowMap(Light* light)
+{
+	int slot = light->point_shadow_slot;
+	if (slot < 0 || !point_shadow_shader)
+		return;
+
+	//cubemap faces in the order of gl_Layer, with the orientation expected by the cubemap lookups
+	static const Vector3 face_dirs[6] = { Vector3(1, 0, 0), Vector3(-1, 0, 0), Vector3(0, 1, 0), Vector3(0, -1, 0), Vector3(0, 0, 1), Vector3(0, 0, -1) };
+	static const Vector3 face_ups[6] = { Vector3(0, -1, 0), Vector3(0, -1, 0), Vector3(0, 0, 1), Vector3(0, 0, -1), Vector3(0, -1, 0), Vector3(0, -1, 0) };
+	static Camera face_cameras[6];
+
+	Vector3 light_pos = light->model.getTranslation();
+	Matrix44 face_viewprojection[6];
+	for (int i = 0; i < 6; ++i)
+	{
+		face_cameras[i].lookAt(light_pos, light_pos + face_dirs[i], face_ups[i]);
+		face_cameras[i].setPerspective(90.0f, 1.0f, 1.0f, light->maxDist);
+		face_viewprojection[i] = face_cameras[i].viewprojection_matrix;
+	}
+
+	point_shadow_fbos[slot]->bind();
+	GLState::depthMask(true);
+	glClear(GL_DEPTH_BUFFER_BIT);
+
+	GLState::disable(GL_BLEND);
+	GLState::enable(GL_DEPTH_TEST);
+	GLState::disable(GL_CULL_FACE);
+	GLState::depthFunc(GL_LEQUAL);
+
+	//masked casters also read the uvs to cut by the alpha, the rest only the positions
+	Shader* shaders[2] = { point_shadow_shader, point_shadow_masked_shader };
+	for (int i = 0; i < 2; ++i)
+	{
+		if (!shaders[i])
+			continue;
+		shaders[i]->enable();
+		shaders[i]->setMatrix44Array(u_face_viewprojection_id, face_viewprojection, 6);
+		shaders[i]->setUniform(u_light_position_id, light_pos);
+		shaders[i]->setUniform(u_light_maxdist_id, light->maxDist);
+	}
+
+	std::vector<Node*>& nodes = point_shadow_nodes;
+	for (PrefabEntity* e : Scene::getInstance()->prefabEntities)
+	{
+		if (!e->visible)
+			continue;
+		nodes.clear();
+		nodes.push_back(&e->pPrefab->root);
+		while (nodes.size())
+		{
+			Node* node = nodes.back();
+			nodes.pop_back();
+			if (!node->visible)
+				continue;
+
+			//parents are visited before their children, so the fast global matrix is up to date
+			Matrix44 node_model = node->getGlobalMatrix(true) * e->model;
+			for (int i = 0; i < node->children.size(); ++i)
+				nodes.push_back(node->children[i]);
+
+			if (!node->mesh || !node->material || node->material->alpha_mode == GTR::AlphaMode::BLEND)
+				continue;
+
+			BoundingBox world_bounding = transformBoundingBox(node_model, node->mesh->box);
+			if (!BoundingBoxSphereOverlap(world_bounding, light_pos, light->maxDist))
+				continue;
+
+			int face_mask = 0;
+			for (int i = 0; i < 6; ++i)
+				if (face_cameras[i].testBoxInFrustum(world_bounding.center, world_bounding.halfsize))
+					face_mask |= 1 << i;
+			if (!face_mask)
+				continue;
+
+			bool masked = node->material->alpha_mode == GTR::AlphaMode::MASK && point_shadow_masked_shader;
+			Shader* shader = shaders[masked ? 1 : 0];
+			shader->enable();
+			shader->setUniform(u_face_mask_id, face_mask);
+			shader->setUniform(u_model_id, node_model);
+			if (masked)
+			{
+				uploadMaterialData(node->material);
+				shader->setUniform(u_texture_id, node->material->color_texture ? node->material->color_texture : Texture::getWhiteTexture(), 0);
+			}
+			node->mesh->render(GL_TRIANGLES, -1, 0, !masked);
+		}
+	}
+
+	if (Shader::current)
+		Shader::current->disable();
+	point_shadow_fbos[slot]->unbind();
+}
+
+//uniforms shared by the shaders of the lighting pass of the deferred
+void Renderer::setLightingPassUniforms(Shader* shader, int width, int height)
+{
+	//camera pass (the camera block was filled in the geometry pass)
+	shader->setUniform(u_iRes_id, Vector2(1.0 / (float)width, 1.0 / (float)height));
+
+	//texture pass, the compact layout has metal and roughness in the alpha and blue of the first two
+	shader->setUniform(u_gbuffer_compact_id, fbo_compact);
+	shader->setUniform(u_color_texture_id, this->fbo->color_textures[0], 0);
+	shader->setUniform(u_normal_texture_id, this->fbo->color_textures[1], 1);
+	if (!fbo_compact)
+		shader->setUniform(u_metal_roughness_texture_id, this->fbo->color_textures[2], 2);
+	shader->setUniform(u_depth_texture_id, this->fbo->depth_texture, 3);
+
+	//lights pass
+	shader->setUniform(u_ambient_light_id, Scene::getInstance()->ambientLight);
+	bindShadowMaps(shader, 4);
+}
+
+//returns the mesh enclosing the range of a point or spot light and its transform
+Mesh* Renderer::getLightVolume(Light* light, Matrix44& model)
+{
+	static Mesh* sphere = NULL;
+	static Mesh* cone = NULL;
+	const int cone_slices = 16;
+	if (!sphere)
+	{
+		sphere = new Mesh();
+		sphere->createSphere();
+		sphere->uploadToVRAM();
+		cone = new Mesh();
+		cone->createCone(cone_slices);
+		cone->uploadToVRAM();
+	}
+
+	//the meshes are low poly so they are scaled up a bit to enclose the real shapes
+	float radius = light->maxDist * 1.1f;
+
+	//wide spots are cheaper to draw with the sphere
+	if (light->light_type == lightType::SPOT && light->angleCutoff < 60)
+	{
+		//the vertices of the base are on the circle, so the edges are moved out to it
+		float base_radius = radius * tan(DEG2RAD * light->angleCutoff) / cos(PI / cone_slices);
+		model = light->model;
+		model.scale(base_radius, base_radius, radius);
+		return cone;
+	}
+
+	Vector3 pos = light->model.getTranslation();
+	model.setTranslation(pos.x, pos.y, pos.z);
+	model.scale(radius, radius, radius);
+	return sphere;
+}
+
+//bins the lights of the frame in screen tiles, every tile stores a mask with one bit per light
+//directional lights touch every tile, point and spot lights only the tiles covered by their range
+void Renderer::computeLightTiles(Camera* camera, int width, int height)
+{
+	int tiles_x = (width + tile_size - 1) / tile_size;
+	int tiles_y = (height + tile_size - 1) / tile_size;
+
+	std::vector<int> masks(tiles_x * tiles_y, 0);
+
+	for (size_t i = 0; i < frame_lights.size() && i < MAX_LIGHTS; ++i)
+	{
+		Light* light = frame_lights[i];
+		int min_x = 0, min_y = 0, max_x = tiles_x - 1, max_y = tiles_y - 1;
+
+		if (light->light_type != lightType::DIRECTIONAL)
+		{
+			Vector3 pos = light->model.getTranslation();
+			float radius = light->maxDist;
+			if (camera->testSphereInFrustum(pos, radius) == CLIP_OUTSIDE)
+				continue;
+
+			//project the box around the sphere, if the camera is inside or a corner is behind it the light could cover any pixel
+			bool fullscreen = camera->eye.distance(pos) < radius + camera->near_plane;
+			Vector2 rect_min(1, 1), rect_max(-1, -1);
+			for (int j = 0; j < 8 && !fullscreen; ++j)
+			{
+				Vector3 corner = pos + Vector3(j & 1 ? radius : -radius, j & 2 ? radius : -radius, j & 4 ? radius : -radius);
+				Vector4 proj = camera->viewprojection_matrix * Vector4(corner, 1.0);
+				if (proj.w <= 0.0)
+				{
+					fullscreen = true;
+					break;
+				}
+				rect_min.x = std::min(rect_min.x, proj.x / proj.w);
+				rect_min.y = std::min(rect_min.y, proj.y / proj.w);
+				rect_max.x = std::max(rect_max.x, proj.x / proj.w);
+				rect_max.y = std::max(rect_max.y, proj.y / proj.w);
+			}
+
+			if (!fullscreen)
+			{
+				min_x = (int)clamp((rect_min.x * 0.5f + 0.5f) * width / tile_size, 0, tiles_x - 1);
+				min_y = (int)clamp((rect_min.y * 0.5f + 0.5f) * height / tile_size, 0, tiles_y - 1);
+				max_x = (int)clamp((rect_max.x * 0.5f + 0.5f) * width / tile_size, 0, tiles_x - 1);
+				max_y = (int)clamp((rect_max.y * 0.5f + 0.5f) * height / tile_size, 0, tiles_y - 1);
+			}
+		}
+
+		for (int y = min_y; y <= max_y; ++y)
+			for (int x = min_x; x <= max_x; ++x)
+				masks[x + y * tiles_x] |= 1 << i;
+	}
+
+	//masks of 16 bits are stored exactly in a float texture
+	tiles_masks.resize(masks.size());
+	for (size_t i = 0; i < masks.size(); ++i)
+		tiles_masks[i] = (float)masks[i];
+
+	if (!tiles_texture)
+		tiles_texture = new Texture();
+	if (tiles_texture->width != tiles_x || tiles_texture->height != tiles_y)
+		tiles_texture->create(tiles_x, tiles_y, GL_RED, GL_FLOAT, false, (Uint8*)&tiles_masks[0], GL_R32F);
+	else
+		tiles_texture->upload(GL_RED, GL_FLOAT, false, (Uint8*)&tiles_masks[0], GL_R32F);
+}
+
+void Renderer::uploadCameraData(Camera* camera)
+{
+	sCameraData data;
+	data.viewprojection = camera->viewprojection_matrix;
+	data.inverse_viewprojection = camera->viewprojection_matrix;
+	data.inverse_viewprojection.inverse();
+	data.camera_pos = camera->eye;
+	data.near_plane = camera->near_plane;
+	data.far_plane = camera->far_plane;
+	camera_ubo->upload(&data, sizeof(data));
+}
+
+//the light index used by the shaders is the position of the light in frame_lights inside its group
+void Renderer::uploadLightsData()
+{
+	frame_lights.clear();
+	for (Light* light : Scene::getInstance()->lightEntities)
+		if (light->visible)
+			frame_lights.push_back(light);
+
+	int num_groups = std::max(((int)frame_lights.size() + MAX_LIGHTS - 1) / MAX_LIGHTS, 1);
+	while (lights_ubos.size() < num_groups)
+	{
+		UBO* ubo = new UBO();
+		ubo->create(sizeof(sLightsData), UBO_LIGHTS);
+		lights_ubos.push_back(ubo);
+	}
+
+	for (int group = 0; group < num_groups; ++group)
+		uploadLightGroup(group);
+
+	//creating a buffer binds it, the first group is the one seen by default
+	bound_light_group = -1;
+	bindLight(0);
+}
+
+void Renderer::uploadLightGroup(int group)
+{
+	sLightsData data = {};
+	int first = group * MAX_LIGHTS;
+	data.num_lights = std::min((int)frame_lights.size() - first, MAX_LIGHTS);
+
+	for (int i = 0; i < data.num_lights; ++i)
+	{
+		Light* light = frame_lights[first + i];
+		sLightData& ld = data.lights[i];
+		ld.position = light->model.getTranslation();
+		ld.maxdist = light->maxDist;
+		ld.color = light->color;
+		ld.intensity = light->intensity;
+		ld.direction = light->model.frontVector();
+		ld.spot_cosine = (float)cos(DEG2RAD * light->angleCutoff);
+		ld.spot_exponent = light->spotExponent;
+		ld.type = (int)light->light_type;
+		ld.is_cascade = light->is_cascade ? 1 : 0;
+		if (light->camera)
+			ld.shadow_viewprojection = light->camera->viewprojection_matrix;
+		for (int j = 0; j < 4; ++j)
+			ld.shadow_viewprojection_array[j] = light->shadow_viewprojection[j];
+
+		ld.has_shadow = shadow_atlas && light->shadow_rect.z > 0 ? 1 : 0;
+		if (ld.has_shadow)
+			ld.shadow_rect = light->shadow_rect * (1.0f / shadow_atlas_size);
+		else if (light->light_type == lightType::POINT_LIGHT && light->point_shadow_slot >= 0)
+		{
+			//point lights store the index of their cubemap instead of a tile
+			ld.has_shadow = 1;
+			ld.shadow_rect.set((float)light->point_shadow_slot, 0, 0, 0);
+		}
+	}
+
+	lights_ubos[group]->upload(&data, sizeof(data));
+}
+
+int Renderer::bindLight(int index)
+{
+	int group = index / MAX_LIGHTS;
+	if (group != bound_light_group)
+	{
+		glBindBufferBase(GL_UNIFORM_BUFFER, UBO_LIGHTS, lights_ubos[group]->ubo_id);
+		bound_light_group = group;
+	}
+	return index % MAX_LIGHTS;
+}
+
+void Renderer::uploadMaterialData(Material* material)
+{
+	if (material == current_material)
+		return;
+	current_material = material;
+
+	sMaterialData data;
+	data.color = material->color;
+	data.emissive_factor = material->emissive_factor;
+	//this is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
+	data.alpha_cutoff = material->alpha_mode == GTR::AlphaMode::MASK ? material->alpha_cutoff : 0;
+	data.tilling_factor = material->tilling_factor;
+	data.roughness_factor = material->roughness_factor;
+	data.metallic_factor = material->metallic_factor;
+	data.padding = 0;
+	material_ubo->upload(&data, sizeof(data));
+}
+
+//renders all the prefab entities of the scene
+void Renderer::renderScene(Camera* camera)
+{
+	uploadCameraData(camera);
+	current_material = NULL; //materials could have been edited since last view
+
+	{
+		CPUZone zone("traverse and cull");
+		clearRenderQueue();
+		for (PrefabEntity* e : Scene::getInstance()->prefabEntities)
+		{
+			if (!e->visible)
+				continue;
+			addPrefabToQueue(e->model, e->pPrefab, camera);
+		}
+	}
+	{
+		CPUZone zone("sort");
+		sortRenderQueue(camera);
+	}
+	CPUZone zone("draw");
+	renderQueue(camera);
+}
+
 //renders all the prefab
 void Renderer::renderPrefab(const Matrix44& model, GTR::Prefab* prefab, Camera* camera)
+{
+	uploadCameraData(camera);
+	current_material = NULL;
+
+	clearRenderQueue();
+	addPrefabToQueue(model, prefab, camera);
+	sortRenderQueue(camera);
+	renderQueue(camera);
+}
+
+void Renderer::addPrefabToQueue(const Matrix44& model, GTR::Prefab* prefab, Camera* camera)
 {
 	//assign the model to the root node
-	renderNode(model, &prefab->root, camera);
+	addNodeToQueue(model, &prefab->root, camera);
 }
 
-//renders a node of the prefab and its children
-void Renderer::renderNode(const Matrix44& prefab_model, GTR::Node* node, Camera* camera)
+//collects a node of the prefab and its children
+void Renderer::addNodeToQueue(const Matrix44& prefab_model, GTR::Node* node, Camera* camera)
 {
 	if (!node->visible)
 		return;
@@ -40,23 +653,113 @@ void Renderer::renderNode(const Matrix44& prefab_model, GTR::Node* node, Camera*
 		//if bounding box is inside the camera frustum then the object is probably visible
 		if (camera->testBoxInFrustum(world_bounding.center, world_bounding.halfsize) )
 		{
-			if (shadow)
-				renderPrefabShadowMap(node_model, node->mesh, node->material, camera);
-			else if (deferred)
-				renderMeshInDeferred(node_model, node->mesh, node->material, camera);
-			else
-				renderMeshWithMaterial(node_model, node->mesh, node->material, camera);
-			//node->mesh->renderBounding(node_model, true);
+			RenderCall rc;
+			rc.node = node;
+			rc.mesh = node->mesh;
+			rc.material = node->material;
+			rc.model = node_model;
+			rc.distance = (float)camera->eye.distance(world_bounding.center);
+			rc.key = 0;
+			render_queue.push_back(rc);
 		}
 	}
 
 	//iterate recursively with children
 	for (int i = 0; i < node->children.size(); ++i)
-		renderNode(prefab_model, node->children[i], camera);
+		addNodeToQueue(prefab_model, node->children[i], camera);
+}
+
+//pass: 4 bits, shader: 8 bits, material: 16 bits, mesh: 16 bits, depth: 20 bits
+//blended calls must be drawn back to front so the depth goes before the state
+uint64 Renderer::computeRenderKey(int pass, Shader* shader, Material* material, Mesh* mesh, float depth)
+{
+	uint64 pass_bits = (uint64)(pass & 0xF);
+	uint64 shader_bits = (uint64)(((size_t)shader >> 4) & 0xFF);
+	//the indices only repeat after 65536 meshes or materials, pointer bits could collide much sooner
+	uint64 material_bits = (uint64)(material->index & 0xFFFF);
+	uint64 mesh_bits = (uint64)(mesh->index & 0xFFFF);
+	uint64 depth_bits = (uint64)(clamp(depth, 0.0f, 1.0f) * 0xFFFFF);
+
+	if (pass == GTR::AlphaMode::BLEND)
+		return (pass_bits << 60) | ((0xFFFFF - depth_bits) << 40) | (shader_bits << 32) | (material_bits << 16) | mesh_bits;
+	return (pass_bits << 60) | (shader_bits << 52) | (material_bits << 36) | (mesh_bits << 20) | depth_bits;
+}
+
+Shader* Renderer::getPassShader()
+{
+	if (shadow)
+		return shadow_shader;
+	else if (deferred)
+		return deferred_shader;
+	return light_shader;
+}
+
+void Renderer::sortRenderQueue(Camera* camera)
+{
+	Shader* shader = getPassShader();
+
+	for (RenderCall& rc : render_queue)
+		rc.key = computeRenderKey(rc.material->alpha_mode, shader, rc.material, rc.mesh, rc.distance / camera->far_plane);
+
+	std::sort(render_queue.begin(), render_queue.end(),
+		[](const RenderCall& a, const RenderCall& b) { return a.key < b.key; });
+}
+
+void Renderer::renderQueue(Camera* camera)
+{
+	size_t i = 0;
+	while (i < render_queue.size())
+	{
+		const RenderCall& rc = render_queue[i];
+
+		//consecutive calls sharing mesh and material are drawn with one instanced call
+		//blended calls are never batched because they must keep their order
+		size_t end = i + 1;
+		if (use_instancing && rc.material->alpha_mode != GTR::AlphaMode::BLEND)
+			while (end < render_queue.size() && render_queue[end].mesh == rc.mesh && render_queue[end].material == rc.material)
+				end++;
+
+		if (end - i > 1)
+		{
+			instanced_models.clear();
+			for (size_t j = i; j < end; ++j)
+				instanced_models.push_back(render_queue[j].model);
+			renderCall(rc, camera, &instanced_models[0], (int)instanced_models.size());
+		}
+		else
+			renderCall(rc, camera);
+
+		i = end;
+	}
+
+	//the shader stays enabled between calls, so it is only disabled at the end
+	if (Shader::current)
+		Shader::current->disable();
+}
+
+//submits one collected draw with the function of the current pass
+void Renderer::renderCall(const RenderCall& rc, Camera* camera, const Matrix44* instanced_models, int num_instances)
+{
+	if (shadow)
+		renderPrefabShadowMap(rc.model, rc.mesh, rc.material, camera, instanced_models, num_instances);
+	else if (deferred)
+		renderMeshInDeferred(rc.model, rc.mesh, rc.material, camera, instanced_models, num_instances);
+	else
+		renderMeshWithMaterial(rc.model, rc.mesh, rc.material, camera, instanced_models, num_instances);
+	//rc.mesh->renderBounding(rc.model, true);
+}
+
+//does the draw call, using instancing when several models were batched
+static void drawMesh(Mesh* mesh, const Matrix44* instanced_models, int num_instances, bool positions_only = false)
+{
+	if (num_instances)
+		mesh->renderInstanced(GL_TRIANGLES, instanced_models, num_instances, positions_only);
+	else
+		mesh->render(GL_TRIANGLES, -1, 0, positions_only);
 }
 
 //renders a mesh given its transform and material
-void Renderer::renderMeshWithMaterial(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera)
+void Renderer::renderMeshWithMaterial(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera, const Matrix44* instanced_models, int num_instances)
 {
 	//in case there is nothing to do
 	if (!mesh || !mesh->getNumVertices() || !material)
@@ -79,21 +782,21 @@ void Renderer::renderMeshWithMaterial(const Matrix44 model, Mesh* mesh, GTR::Mat
 	//select the blending
 	if (material->alpha_mode == GTR::AlphaMode::BLEND)
 	{
-		glEnable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		GLState::enable(GL_BLEND);
+		GLState::blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	}
 	else
-		glDisable(GL_BLEND);
+		GLState::disable(GL_BLEND);
 
 	//select if render both sides of the triangles
 	if (material->two_sided)
-		glDisable(GL_CULL_FACE);
+		GLState::disable(GL_CULL_FACE);
 	else
-		glEnable(GL_CULL_FACE);
+		GLState::enable(GL_CULL_FACE);
 	assert(glGetError() == GL_NO_ERROR);
 
 	//chose a shader
-	shader = Shader::Get("light");
+	shader = num_instances ? light_instanced_shader : light_shader;
 
 	assert(glGetError() == GL_NO_ERROR);
 
@@ -102,268 +805,393 @@ void Renderer::renderMeshWithMaterial(const Matrix44 model, Mesh* mesh, GTR::Mat
 		return;
 	shader->enable();
 
-	glDepthFunc(GL_LEQUAL);
-
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE);
-
-	if (Scene::getInstance()->lightEntities.empty())
-	{
-		glDisable(GL_BLEND);
-		glDisable(GL_DEPTH);
+	GLState::depthFunc(GL_LEQUAL);
 
-		shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-		shader->setUniform("u_camera_pos", camera->eye);
-		shader->setUniform("u_model", model);
-		shader->setUniform("u_ambient_light", Scene::getInstance()->ambientLight);
+	//camera and lights are already in their uniform buffers
+	uploadMaterialData(material);
+	shader->setUniform(u_model_id, model);
+	if (texture)
+		shader->setUniform(u_texture_id, texture, 0);
+	if (emissive_texture)
+		shader->setUniform(u_emissive_texture_id, emissive_texture, 1);
 
-		shader->setUniform("u_color", material->color);
-		if (texture)
-			shader->setUniform("u_texture", texture, 0);
-		if (emissive_texture)
-			shader->setUniform("u_emissive_texture", emissive_texture, 1);
-		shader->setUniform("u_emissive_factor", material->emissive_factor);
+	bindShadowMaps(shader, 3);
 
-		//this is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
-		shader->setUniform("u_alpha_cutoff", material->alpha_mode == GTR::AlphaMode::MASK ? material->alpha_cutoff : 0);
+	if ((int)frame_lights.size() <= max_single_pass_lights)
+	{
+		//all the lights accumulated in one draw, the blending is the one of the material
+		shader->setUniform(u_single_pass_id, true);
+		shader->setUniform(u_ambient_light_id, Scene::getInstance()->ambientLight);
 
 		//do the draw call that renders the mesh into the screen
-		mesh->render(GL_TRIANGLES);
+		drawMesh(mesh, instanced_models, num_instances);
 	}
 	else {
+		//one pass per light added with blending
+		shader->setUniform(u_single_pass_id, false);
+		GLState::blendFunc(GL_SRC_ALPHA, GL_ONE);
 
-		shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-		shader->setUniform("u_camera_pos", camera->eye);
-		shader->setUniform("u_model", model);
-		shader->setUniform("u_factor", material->tilling_factor);
+		Vector3 ambient_light = Scene::getInstance()->ambientLight;
 
-		for (size_t i = 0; i < Scene::getInstance()->lightEntities.size(); i++)
+		for (size_t i = 0; i < frame_lights.size(); i++)
 		{
-			Light* light = Scene::getInstance()->lightEntities.at(i);
-
-			if (!light->visible)
-				continue;
-
 			if (i == 0 && material->alpha_mode != GTR::AlphaMode::BLEND)
-				glDisable(GL_BLEND);
+				GLState::disable(GL_BLEND);
 			else if (i == 0 && material->alpha_mode == GTR::AlphaMode::BLEND)
 			{
-				glEnable(GL_BLEND);
+				GLState::enable(GL_BLEND);
 			}
 			else {
-				glEnable(GL_BLEND);
-				Scene::getInstance()->ambientLight = Vector3(0, 0, 0);
+				GLState::enable(GL_BLEND);
+				ambient_light = Vector3(0, 0, 0);	//only added by the first light
 			}
 
 			//upload uniforms
-			shader->setUniform("u_ambient_light", Scene::getInstance()->ambientLight);
-
-			shader->setUniform("u_is_cascade", light->is_cascade);
-			if (light->light_type == lightType::SPOT || !light->is_cascade)
-				shader->setUniform("u_shadow_viewprojection", light->camera->viewprojection_matrix);
-			else if (light->light_type == lightType::DIRECTIONAL && light->is_cascade)
-				shader->setMatrix44Array("u_shadow_viewprojection_array", light->shadow_viewprojection, 4);
-			shader->setUniform("u_light_position", light->model.getTranslation());
-			shader->setUniform("u_light_color", light->color);
-			shader->setUniform("u_light_maxdist", light->maxDist);
-			shader->setUniform("u_light_intensity", light->intensity);
-			shader->setUniform1("u_light_type", (int)light->light_type);
-			shader->setUniform("u_light_direction", light->model.frontVector());
-			shader->setUniform("u_light_spot_cosine", (float)cos(DEG2RAD * light->angleCutoff));
-			shader->setUniform("u_light_spot_exponent", light->spotExponent);
-			shader->setUniform("u_shadow_map", (light->shadowMap) ? light->shadowMap : Texture::getWhiteTexture(), 3);
-
-			shader->setUniform("u_color", material->color);
-			if (texture)
-				shader->setUniform("u_texture", texture, 0);
-			if (emissive_texture)
-				shader->setUniform("u_emissive_texture", emissive_texture, 1);
-			shader->setUniform("u_emissive_factor", material->emissive_factor);
-
-			//this is used to say which is the alpha threshold to what we should not paint a pixel on the screen (to cut polygons according to texture alpha)
-			shader->setUniform("u_alpha_cutoff", material->alpha_mode == GTR::AlphaMode::MASK ? material->alpha_cutoff : 0);
+			shader->setUniform(u_ambient_light_id, ambient_light);
+			shader->setUniform(u_light_index_id, bindLight((int)i));
 
 			//do the draw call that renders the mesh into the screen
-			mesh->render(GL_TRIANGLES);
+			drawMesh(mesh, instanced_models, num_instances);
 		}
+		bindLight(0);
 	}
-	//disable shader
-	shader->disable();
-
 	//set the render state as it was before to avoid problems with future renders
-	glDisable(GL_BLEND);
+	GLState::disable(GL_BLEND);
 }
 
 
-void Renderer::renderPrefabShadowMap(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera)
+//depth only: opaque casters only read the positions, masked ones also need the uvs to cut by the alpha
+void Renderer::renderPrefabShadowMap(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera, const Matrix44* instanced_models, int num_instances)
 {
-	if (!mesh || !mesh->getNumVertices())
+	if (!mesh || !mesh->getNumVertices() || !material)
 		return;
 
-	Shader* shadow_shader = Shader::Get("flat");
-	if (!shadow_shader)
+	//transparent objects dont cast shadows
+	if (material->alpha_mode == GTR::AlphaMode::BLEND)
 		return;
 
-	shadow_shader->enable();
-
-	if (material->alpha_mode == GTR::AlphaMode::BLEND)
+	bool masked = material->alpha_mode == GTR::AlphaMode::MASK;
+	Shader* shader = NULL;
+	if (masked)
+		shader = num_instances ? shadow_masked_instanced_shader : shadow_masked_shader;
+	else
+		shader = num_instances ? shadow_instanced_shader : shadow_shader;
+	if (!shader)
 		return;
 
-	glDisable(GL_BLEND);
-	glEnable(GL_DEPTH_TEST);
-	glDisable(GL_CULL_FACE);
+	shader->enable();
 
-	glDepthFunc(GL_LEQUAL);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+	GLState::disable(GL_BLEND);
+	GLState::enable(GL_DEPTH_TEST);
+	GLState::disable(GL_CULL_FACE);
+	GLState::depthFunc(GL_LEQUAL);
 
-	shadow_shader->setUniform("u_model", model);
-	shadow_shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-	shadow_shader->setUniform("u_camera_pos", camera->eye);
+	shader->setUniform(u_model_id, model);
+	if (masked)
+	{
+		uploadMaterialData(material);
+		shader->setUniform(u_texture_id, material->color_texture ? material->color_texture : Texture::getWhiteTexture(), 0);
+	}
 
-	mesh->render(GL_TRIANGLES);
+	drawMesh(mesh, instanced_models, num_instances, !masked);
+}
 
-	shadow_shader->disable();
+//gbuffers of the current layout
+sRenderTargetDesc Renderer::getGBuffersDesc(int width, int height)
+{
+	if (compact_gbuffer)
+	{
+		int internal_formats[2] = { GL_SRGB8_ALPHA8, GL_RGB10_A2 };
+		return sRenderTargetDesc(width, height, 2, internal_formats);
+	}
+	int internal_formats[3] = { GL_RGB8, GL_RGB8, GL_RGB8 };
+	return sRenderTargetDesc(width, height, 3, internal_formats);
+}
 
-};
+void Renderer::setGBuffers(FBO* gbuffers)
+{
+	this->fbo = gbuffers;
+	fbo_compact = gbuffers && gbuffers->num_color_textures == 2;
+}
 
+//without a frame graph the targets are taken from the pool only for this call
 void Renderer::renderDeferred(Camera* camera)
 {
 	int width = Application::instance->window_width;
 	int height = Application::instance->window_height;
-	this->deferred = true;
-	this->show_GBuffers = false;
+	FBO* gbuffers = render_targets->acquire(getGBuffersDesc(width, height));
+	FBO* hdr = render_targets->acquire(getHDRDesc(width, height));
+
+	renderGBuffers(camera, gbuffers);
+	hdr->bind();
+	renderDeferredLighting(camera, gbuffers);
+	hdr->unbind();
+	if (auto_exposure)
+		computeLuminance(hdr);
+	renderTonemap(hdr);
+	if (show_GBuffers)
+		renderGBuffersDebug(camera, gbuffers);
+
+	render_targets->release(hdr);
+	render_targets->release(gbuffers);
+}
 
-	Shader* second_pass = NULL;
+sRenderTargetDesc Renderer::getHDRDesc(int width, int height)
+{
+	int internal_formats[1] = { GL_RGBA16F };
+	return sRenderTargetDesc(width, height, 1, internal_formats);
+}
+
+//log luminance of the frame in a small texture whose mipmaps average it, the last mip is read back some frames later
+void Renderer::computeLuminance(FBO* hdr)
+{
+	if (!luminance_shader)
+		return;
 
-	//create fbo in case it hasn't been created before
-	if (!this->fbo)
+	if (!luminance_texture)
 	{
-		this->fbo = new FBO;
-		this->fbo->create(width, height, 3, GL_RGB);
+		luminance_texture = new Texture(256, 256, GL_RED, GL_FLOAT, true, NULL, GL_R16F);
+		luminance_fbo = new FBO();
+		luminance_fbo->setTexture(luminance_texture);
+		glGenBuffers(3, luminance_pbos);
+		for (int i = 0; i < 3; ++i)
+		{
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, luminance_pbos[i]);
+			glBufferData(GL_PIXEL_PACK_BUFFER, sizeof(float), NULL, GL_STREAM_READ);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
 	}
 
-	//first pass - Geometry
+	GLState::disable(GL_BLEND);
+	GLState::disable(GL_DEPTH_TEST);
+	luminance_fbo->bind();
+	hdr->color_textures[0]->toViewport(luminance_shader);
+	luminance_fbo->unbind();
+	luminance_texture->generateMipmaps();
+
+	readLuminance();
+
+	//copy the 1x1 mip to a free pixel buffer, if all of them are waiting for the GPU this frame is skipped
+	if (luminance_fences[luminance_write])
+		return;
+	int last_level = (int)log2(luminance_texture->width);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, luminance_pbos[luminance_write]);
+	GLState::bindTexture(GL_TEXTURE_2D, luminance_texture->texture_id);
+	glGetTexImage(GL_TEXTURE_2D, last_level, GL_RED, GL_FLOAT, 0);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	luminance_fences[luminance_write] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	luminance_write = (luminance_write + 1) % 3;
+}
+
+//takes the newest readback the GPU already finished, without waiting
+void Renderer::readLuminance()
+{
+	for (int k = 0; k < 3; ++k)
+	{
+		int i = (luminance_write + k) % 3;	//from the oldest
+		if (!luminance_fences[i])
+			continue;
+		GLenum result = glClientWaitSync(luminance_fences[i], 0, 0);
+		if (result != GL_ALREADY_SIGNALED && result != GL_CONDITION_SATISFIED)
+			break;
+		glDeleteSync(luminance_fences[i]);
+		luminance_fences[i] = 0;
+
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, luminance_pbos[i]);
+		float* data = (float*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, sizeof(float), GL_MAP_READ_BIT);
+		if (data)
+		{
+			average_luminance = (float)exp(data[0]);
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	}
+}
+
+//moves the exposure smoothly towards the one that maps the average luminance to the key
+void Renderer::updateExposure(float elapsed_time)
+{
+	if (!auto_exposure)
+		return;
+	float target = exposure_key / std::max(average_luminance, 0.0001f);
+	exposure += (target - exposure) * (1.0f - (float)exp(-elapsed_time * exposure_adaptation));
+}
+
+//to the framebuffer that is bound, with gamma
+void Renderer::renderTonemap(FBO* hdr)
+{
+	if (!tonemap_shader)
+		return;
+	GLState::disable(GL_BLEND);
+	GLState::disable(GL_DEPTH_TEST);
+	tonemap_shader->enable();
+	tonemap_shader->setUniform(u_exposure_id, exposure);
+	hdr->color_textures[0]->toViewport(tonemap_shader);
+}
+
+//first pass - Geometry
+void Renderer::renderGBuffers(Camera* camera, FBO* gbuffers)
+{
+	setGBuffers(gbuffers);
+	this->deferred = true;
+
 	this->fbo->bind();
 
+	//the albedo is written in linear space and stored in sRGB (only affects the sRGB target)
+	if (fbo_compact)
+		GLState::enable(GL_FRAMEBUFFER_SRGB);
+
 	//glClearColor(0.1, 0.1, 0.1, 1.0);
 	glClearColor(0.0, 0.0, 0.0, 1.0);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-	glEnable(GL_DEPTH_TEST);
-	glDepthFunc(GL_LEQUAL);
-	glDisable(GL_BLEND);
-	glBlendFunc(GL_ONE, GL_ONE);
+	GLState::enable(GL_DEPTH_TEST);
+	GLState::depthFunc(GL_LEQUAL);
+	GLState::disable(GL_BLEND);
+	GLState::blendFunc(GL_ONE, GL_ONE);
 
-	for (PrefabEntity* e : Scene::getInstance()->prefabEntities)
-	{
-		renderPrefab(e->model, e->pPrefab, camera);
-	}
+	renderScene(camera);
 
+	GLState::disable(GL_FRAMEBUFFER_SRGB);
 	this->fbo->unbind();
+	this->deferred = false;
+}
 
-	//second pass - light
+//second pass - light, into the framebuffer that is bound
+void Renderer::renderDeferredLighting(Camera* camera, FBO* gbuffers)
+{
+	setGBuffers(gbuffers);
+	int width = gbuffers->width;
+	int height = gbuffers->height;
+	Shader* second_pass = NULL;
 
-	glDisable(GL_BLEND);
-	glDisable(GL_DEPTH_TEST);
+	GLState::disable(GL_BLEND);
+	GLState::disable(GL_DEPTH_TEST);
 
-	//glClearColor(0.0, 0.0, 0.0, 1.0);
-	glClearColor(0.1, 0.1, 0.1, 1.0);
+	//with light volumes every light is added, so the pixels outside all of them must start black
+	bool light_volumes = use_light_volumes && !tiled_deferred;
+	if (light_volumes)
+		glClearColor(0.0, 0.0, 0.0, 1.0);
+	else
+		glClearColor(0.1, 0.1, 0.1, 1.0);
 	glClear(GL_DEPTH_BUFFER_BIT | GL_COLOR_BUFFER_BIT);
 
 	Mesh* quad = Mesh::getQuad();
-	second_pass = Shader::Get("deferred_pospo");
-	second_pass->enable();
 
-	//camera pass
-	second_pass->setUniform("u_camera_pos", camera->eye);
-	Matrix44 inverse_matrix = camera->viewprojection_matrix;
-	inverse_matrix.inverse();
-	second_pass->setUniform("u_inverse_viewprojection", inverse_matrix);
-	second_pass->setUniform("u_iRes", Vector2(1.0 / (float)width, 1.0 / (float)height));
+	//point and spot lights can be drawn with a mesh enclosing their range
+	Shader* volume_pass = deferred_volume_shader;
+	if (light_volumes)
+	{
+		volume_pass->enable();
+		setLightingPassUniforms(volume_pass, width, height);
+		volume_pass->setUniform(u_light_volume_id, true);
+	}
 
-	//texture pass
-	second_pass->setUniform("u_color_texture", this->fbo->color_textures[0], 0);
-	second_pass->setUniform("u_normal_texture", this->fbo->color_textures[1], 1);
-	second_pass->setUniform("u_metal_roughness_texture", this->fbo->color_textures[2], 2);
-	second_pass->setUniform("u_depth_texture", this->fbo->depth_texture, 3);
+	second_pass = deferred_pospo_shader;
+	second_pass->enable();
+	setLightingPassUniforms(second_pass, width, height);
+	second_pass->setUniform(u_light_volume_id, false);
 
-	//lights pass
-	second_pass->setUniform("u_ambient_light", Scene::getInstance()->ambientLight);
+	if (tiled_deferred)
+	{
+		//every pixel is shaded once against the lights touching its tile
+		computeLightTiles(camera, width, height);
+		second_pass->setUniform(u_tiled_id, true);
+		second_pass->setUniform(u_tiles_texture_id, tiles_texture, 9);
+		second_pass->setUniform(u_tile_size_id, tile_size);
+		GLState::disable(GL_BLEND);
+		{
+			GPUZone zone("tiled lights");
+			quad->render(GL_TRIANGLES);
+		}
+	}
+	second_pass->setUniform(u_tiled_id, false);	//for the passes per light
 
-	bool firstLight = false;
+	//the tiles only have bits for the first group, the rest of the lights are added one pass each
+	bool firstLight = tiled_deferred;
 
 	//multipass
-	for (size_t i = 0; i < Scene::getInstance()->lightEntities.size(); i++)	//pass for all lights
+	for (size_t i = tiled_deferred ? MAX_LIGHTS : 0; i < frame_lights.size(); i++)	//pass for all lights
 	{
-		glDisable(GL_DEPTH_TEST);
-		Light* light = Scene::getInstance()->lightEntities.at(i);
-		if (!light->visible)
-			continue;
+		GLState::disable(GL_DEPTH_TEST);
+		Light* light = frame_lights[i];
+		char zone_name[GPUPROFILER_NAME];
+		snprintf(zone_name, sizeof(zone_name), "light %u (%s)", light->id, light->name.c_str());
+		GPUZone zone(zone_name);
 
-		if (!firstLight) {
+		if (!firstLight && !light_volumes) {
 			firstLight = true;
-			glDisable(GL_BLEND);
+			GLState::disable(GL_BLEND);
 		}
 		else {
-			glEnable(GL_BLEND);
-			glBlendFunc(GL_ONE, GL_ONE);
-			glBlendEquation(GL_FUNC_ADD);
+			GLState::enable(GL_BLEND);
+			GLState::blendFunc(GL_ONE, GL_ONE);
+			GLState::blendEquation(GL_FUNC_ADD);
 			assert(glGetError() == GL_NO_ERROR);
-			//second_pass->setUniform("u_ambient_light", 0.0f);
+			//second_pass->setUniform(u_ambient_light_id, 0.0f);
 		}
 
-		second_pass->setUniform("u_light_type", light->light_type);
-		second_pass->setUniform("u_light_position", light->model.getTranslation());
-		second_pass->setUniform("u_light_intensity", light->intensity);
-		second_pass->setUniform("u_light_color", light->color);
-		second_pass->setUniform("u_light_maxdist", light->maxDist);
-		second_pass->setUniform("u_light_direction", light->model.frontVector());
-		second_pass->setUniform("u_light_spot_cosine", (float)cos(DEG2RAD * light->angleCutoff));
-		second_pass->setUniform("u_light_spot_exponent", light->spotExponent);
-
-		if (light->shadowMap)
+		if (light_volumes && light->light_type != lightType::DIRECTIONAL)
 		{
-			second_pass->setUniform("u_is_cascade", light->is_cascade);
-			if (light->light_type == lightType::SPOT || !light->is_cascade)
-				second_pass->setUniform("u_shadow_viewprojection", light->camera->viewprojection_matrix);
-			else if (light->light_type == lightType::DIRECTIONAL && light->is_cascade)
-				second_pass->setMatrix44Array("u_shadow_viewprojection_array", light->shadow_viewprojection, 4);
-			second_pass->setUniform("u_shadow_map", (light->shadowMap) ? light->shadowMap : Texture::getWhiteTexture(), 4);
+			//only the back faces, so it still works when the camera is inside the volume
+			Matrix44 volume_model;
+			Mesh* volume = getLightVolume(light, volume_model);
+			volume_pass->enable();
+			volume_pass->setUniform(u_light_index_id, bindLight((int)i));
+			volume_pass->setUniform(u_model_id, volume_model);
+			GLState::enable(GL_CULL_FACE);
+			GLState::cullFace(GL_FRONT);
+			volume->render(GL_TRIANGLES);
+			GLState::cullFace(GL_BACK);
+			continue;
 		}
 
+		second_pass->enable();
+		second_pass->setUniform(u_light_index_id, bindLight((int)i));
+
 		quad->render(GL_TRIANGLES);	//render with blending for each light
 	}
+	bindLight(0);
 
 	//in case there is no lights, render the quad
-	if (Scene::getInstance()->lightEntities.empty())
+	if (Scene::getInstance()->lightEntities.empty() && !tiled_deferred)
 		quad->render(GL_TRIANGLES);
 
-	glDisable(GL_DEPTH_TEST);
-	glDisable(GL_BLEND);
+	GLState::disable(GL_DEPTH_TEST);
+	GLState::disable(GL_BLEND);
 
 	//renderLights(camera);
 
 	second_pass->disable();
 
-	if (show_GBuffers) {
-		glViewport(0, height * 0.5, width * 0.5, height * 0.5);
-		this->fbo->color_textures[0]->toViewport();
-		glViewport(width * 0.5, height * 0.5, width * 0.5, height * 0.5);
-		this->fbo->color_textures[1]->toViewport();
-		glViewport(0, 0, width * 0.5, height * 0.5);
+}
+
+//the three gbuffers and the depth in the four quarters of the screen
+void Renderer::renderGBuffersDebug(Camera* camera, FBO* gbuffers)
+{
+	setGBuffers(gbuffers);
+	int width = gbuffers->width;
+	int height = gbuffers->height;
+
+	glViewport(0, height * 0.5, width * 0.5, height * 0.5);
+	this->fbo->color_textures[0]->toViewport();
+	glViewport(width * 0.5, height * 0.5, width * 0.5, height * 0.5);
+	this->fbo->color_textures[1]->toViewport();
+	glViewport(0, 0, width * 0.5, height * 0.5);
+	if (this->fbo->color_textures[2])
 		this->fbo->color_textures[2]->toViewport();
 
-		//depth channel
-		glViewport(width * 0.5, 0, width * 0.5, height * 0.5);
-		Shader* depth_shader = Shader::Get("depth");
-		depth_shader->enable();
-		depth_shader->setUniform("u_camera_nearfar", Vector2(camera->near_plane, camera->far_plane));
-		this->fbo->depth_texture->toViewport(depth_shader);
-		depth_shader->disable();
-	}
+	//depth channel
+	glViewport(width * 0.5, 0, width * 0.5, height * 0.5);
+	depth_shader->enable();
+	depth_shader->setUniform(u_camera_nearfar_id, Vector2(camera->near_plane, camera->far_plane));
+	this->fbo->depth_texture->toViewport(depth_shader);
+	depth_shader->disable();
 
+	glViewport(0, 0, width, height);
 }
 
-void Renderer::renderMeshInDeferred(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera)
+void Renderer::renderMeshInDeferred(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera, const Matrix44* instanced_models, int num_instances)
 {
 
 	if (!mesh || !mesh->getNumVertices())
@@ -373,7 +1201,7 @@ void Renderer::renderMeshInDeferred(const Matrix44 model, Mesh* mesh, GTR::Mater
 	Texture* emissive_texture = NULL;
 	Texture* metal_roughness_texture = NULL;
 
-	Shader* shader = Shader::Get("deferred");
+	Shader* shader = num_instances ? deferred_instanced_shader : deferred_shader;
 	if (!shader)
 		return;
 
@@ -383,58 +1211,48 @@ void Renderer::renderMeshInDeferred(const Matrix44 model, Mesh* mesh, GTR::Mater
 
 	shader->enable();
 
-	glEnable(GL_DEPTH_TEST);
-	glDisable(GL_CULL_FACE);
-	glDepthFunc(GL_LEQUAL);
+	GLState::enable(GL_DEPTH_TEST);
+	GLState::disable(GL_CULL_FACE);
+	GLState::depthFunc(GL_LEQUAL);
 
-	if (material->alpha_mode != GTR::AlphaMode::BLEND)
-		glDisable(GL_BLEND);
+	//the alpha of the compact layout stores the metalness, it cant be blended
+	if (material->alpha_mode != GTR::AlphaMode::BLEND || fbo_compact)
+		GLState::disable(GL_BLEND);
 	else {
-		glEnable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		GLState::enable(GL_BLEND);
+		GLState::blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	}
 
-	//camera uniforms
-	shader->setUniform("u_model", model);
-	shader->setUniform("u_viewprojection", camera->viewprojection_matrix);
-	shader->setUniform("u_camera_pos", camera->eye);
-
 	//object uniforms
-	shader->setUniform("u_color", material->color);
+	shader->setUniform(u_model_id, model);
+	shader->setUniform(u_gbuffer_compact_id, fbo_compact);
+	uploadMaterialData(material);
 
-	shader->setUniform("u_color_texture", color_texture ? color_texture : Texture::getWhiteTexture(), 0);
-	shader->setUniform("u_metal_roughness_texture", metal_roughness_texture ? metal_roughness_texture : Texture::getBlackTexture(), 1);
-
-	mesh->render(GL_TRIANGLES);
-
-	shader->disable();
+	shader->setUniform(u_color_texture_id, color_texture ? color_texture : Texture::getWhiteTexture(), 0);
+	shader->setUniform(u_metal_roughness_texture_id, metal_roughness_texture ? metal_roughness_texture : Texture::getBlackTexture(), 1);
 
+	drawMesh(mesh, instanced_models, num_instances);
 }
 
 void Renderer::renderLights(Camera* camera)
 {
+	uploadCameraData(camera);
+
 	for (Light* light : Scene::getInstance()->lightEntities)
 	{
 		if (!light->mesh)
 			continue;
-		Shader* sh = Shader::Get("flat");
+		Shader* sh = flat_shader;
 
 		sh->enable();
 
-		assert(glGetError() == GL_NO_ERROR);
-		glDisable(GL_BLEND);
-		assert(glGetError() == GL_NO_ERROR);
-		glDisable(GL_DEPTH_TEST);
-		assert(glGetError() == GL_NO_ERROR);
-		glEnable(GL_CULL_FACE);
-		
-		assert(glGetError() == GL_NO_ERROR);
+		GLState::disable(GL_BLEND);
+		GLState::disable(GL_DEPTH_TEST);
+		GLState::enable(GL_CULL_FACE);
 
-		sh->setUniform("u_model", light->model);
-		sh->setUniform("u_camera_pos", camera->eye);
-		sh->setUniform("u_viewprojection", camera->viewprojection_matrix);
+		sh->setUniform(u_model_id, light->model);
 
-		sh->setUniform("u_color", light->color);
+		sh->setUniform(u_color_id, light->color);
 
 		light->mesh->render(GL_TRIANGLES);
 
@@ -1,16 +1,82 @@
 #pragma once
 #include "prefab.h"
+#include "fbopool.h"
 
 //forward declarations
 class Camera;
 class Light;
 class FBO;
+class Shader;
+class UBO;
+class Texture;
+
+//must match the define in the light_block of the shader atlas
+#define MAX_LIGHTS 16
+//must match the define in the shadow_maps of the shader atlas
+#define MAX_POINT_SHADOWS 4
 
 namespace GTR {
 
 	class Prefab;
 	class Material;
-	
+
+	//one draw collected from the scene, it stores everything needed to submit it later
+	struct RenderCall
+	{
+		uint64 key;			//sorting key (pass, shader, material, mesh, depth)
+		Node* node;
+		Mesh* mesh;
+		Material* material;
+		Matrix44 model;		//world matrix of the node
+		float distance;		//distance to the camera
+	};
+
+	//uniform blocks shared by the shaders, they follow the std140 layout of the blocks in the shader atlas
+	struct sCameraData
+	{
+		Matrix44 viewprojection;
+		Matrix44 inverse_viewprojection;
+		Vector3 camera_pos;
+		float near_plane;
+		float far_plane;
+		float padding[3];
+	};
+
+	struct sLightData
+	{
+		Vector3 position;
+		float maxdist;
+		Vector3 color;
+		float intensity;
+		Vector3 direction;
+		float spot_cosine;
+		float spot_exponent;
+		int type;
+		int is_cascade;
+		int has_shadow;
+		Vector4 shadow_rect;	//tile of the light in the shadow atlas, in uv space
+		Matrix44 shadow_viewprojection;
+		Matrix44 shadow_viewprojection_array[4];
+	};
+
+	struct sLightsData
+	{
+		sLightData lights[MAX_LIGHTS];
+		int num_lights;
+		int padding[3];
+	};
+
+	struct sMaterialData
+	{
+		Vector4 color;
+		Vector3 emissive_factor;
+		float alpha_cutoff;
+		float tilling_factor;
+		float roughness_factor;
+		float metallic_factor;
+		float padding;
+	};
+
 	// This class is in charge of rendering anything in our system.
 	// Separating the render from anything else makes the code cleaner
 	class Renderer
@@ -20,25 +86,151 @@ namespace GTR {
 		bool shadow;
 		bool deferred;
 		bool show_GBuffers;
-		FBO* fbo;
+		bool use_instancing;	//batch calls sharing mesh and material in one instanced draw
+		FBO* fbo;	//gbuffers of the deferred pass being rendered
+
+		//compact: albedo + metal in SRGB8_ALPHA8 and octahedral normal + roughness in RGB10_A2
+		//otherwise three RGB8 (albedo, normal, metal roughness)
+		bool compact_gbuffer;
+		bool fbo_compact;	//layout of fbo
+
+		//transient targets of the passes, they follow the size of the window
+		FBOPool* render_targets;
+
+		bool use_deferred;	//otherwise the scene is rendered with the forward light shader
+
+		//the lights are accumulated in an RGBA16F target and the tonemap brings it to the screen
+		float exposure;
+		bool auto_exposure;	//adapts the exposure to the average luminance of the frame
+		float exposure_key;	//luminance of the average pixel after the exposure
+		float exposure_adaptation;	//speed of the adaptation, higher is faster
+		float average_luminance;	//last value read back from the GPU
+		Texture* luminance_texture;	//log luminance of the frame, its last mip is the average
+		FBO* luminance_fbo;
+		GLuint luminance_pbos[3];	//ring of pixel buffers so the readback never waits for the GPU
+		GLsync luminance_fences[3];
+		int luminance_write;	//next pixel buffer to use
+
+		//render queue, reused every frame to avoid reallocations
+		std::vector<RenderCall> render_queue;
+		std::vector<Matrix44> instanced_models;
+
+		//uniform buffers with the camera (once per view), lights (once per frame) and material (once per material change)
+		UBO* camera_ubo;
+		UBO* material_ubo;
+		Material* current_material;	//material stored in material_ubo
+
+		//visible lights of this frame, uploaded in groups of MAX_LIGHTS and the shaders see one group at a time,
+		//single pass shading only uses the first group and the passes per light bind the group of their light
+		std::vector<Light*> frame_lights;
+		std::vector<UBO*> lights_ubos;
+		int bound_light_group;
+
+		//one depth texture shared by all the shadows, every frame each light gets a tile according to its importance
+		FBO* shadow_atlas;
+		int shadow_atlas_size;	//in pixels, it limits the VRAM used by the shadows
+		int min_shadow_tile;
+		int max_shadow_tile;	//for spot lights, directional lights use half the atlas
+
+		//point lights use a depth cubemap, all its faces are rendered in one pass with a geometry shader
+		Texture* point_shadow_maps[MAX_POINT_SHADOWS];
+		FBO* point_shadow_fbos[MAX_POINT_SHADOWS];
+		int point_shadow_size;	//of every face
+		std::vector<Node*> point_shadow_nodes;	//reused to traverse the prefabs
+
+		int max_single_pass_lights;	//forward renders up to this number of lights in one draw, beyond it one pass per light
+
+		//tiled deferred: lights are binned in screen tiles and every pixel is lit in one pass
+		bool tiled_deferred;
+		int tile_size;	//in pixels
+		Texture* tiles_texture;	//one texel per tile with the mask of the lights touching it
+		std::vector<float> tiles_masks;
+
+		bool use_light_volumes;	//without tiles, point and spot lights are drawn as spheres or cones instead of full screen quads
+
+		bool cache_shadows;	//shadow maps are only rendered again when their light or a caster inside them moved
+
+		//shaders used every frame, reloading keeps the same objects so they only need to be resolved again if the atlas adds new ones
+		Shader* light_shader;
+		Shader* light_instanced_shader;
+		Shader* flat_shader;
+		Shader* shadow_shader;	//depth only, for the casters of the shadow maps
+		Shader* shadow_instanced_shader;
+		Shader* shadow_masked_shader;	//depth only that discards the pixels cut by the alpha of the material
+		Shader* shadow_masked_instanced_shader;
+		Shader* deferred_shader;
+		Shader* deferred_instanced_shader;
+		Shader* deferred_volume_shader;
+		Shader* deferred_pospo_shader;
+		Shader* depth_shader;
+		Shader* point_shadow_shader;
+		Shader* point_shadow_masked_shader;
+		Shader* luminance_shader;
+		Shader* tonemap_shader;
+
+		Renderer();
+		void loadShaders();
 
 		//add here your functions
-		void renderDeferred(Camera* camera);
+		void renderDeferred(Camera* camera);	//the three passes below with gbuffers from the pool
+
+		//deferred passes, the frame graph gives them the gbuffers
+		sRenderTargetDesc getGBuffersDesc(int width, int height);
+		void setGBuffers(FBO* gbuffers);
+		void renderGBuffers(Camera* camera, FBO* gbuffers);
+		void renderDeferredLighting(Camera* camera, FBO* gbuffers);
+		void renderGBuffersDebug(Camera* camera, FBO* gbuffers);
 
-		void renderPrefabShadowMap(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera);
+		//HDR, the forward and deferred paths render into the target and these passes follow
+		sRenderTargetDesc getHDRDesc(int width, int height);
+		void computeLuminance(FBO* hdr);
+		void readLuminance();
+		void updateExposure(float elapsed_time);
+		void renderTonemap(FBO* hdr);
 
-		void renderMeshInDeferred(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera);
+		void renderPrefabShadowMap(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera, const Matrix44* instanced_models = NULL, int num_instances = 0);
+
+		void renderMeshInDeferred(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera, const Matrix44* instanced_models = NULL, int num_instances = 0);
 
 		void renderLights(Camera* camera);
-	
+
+		//to render all the prefab entities of the scene using the render queue
+		void renderScene(Camera* camera);
+
 		//to render a whole prefab (with all its nodes)
 		void renderPrefab(const Matrix44& model, GTR::Prefab* prefab, Camera* camera);
 
-		//to render one node from the prefab and its children
-		void renderNode(const Matrix44& model, GTR::Node* node, Camera* camera);
+		//to render one mesh given its material and transformation matrix (or several if instanced_models is passed)
+		void renderMeshWithMaterial(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera, const Matrix44* instanced_models = NULL, int num_instances = 0);
+
+		//render queue: collect the visible nodes, sort them and submit them in order
+		void clearRenderQueue() { render_queue.clear(); }
+		void addPrefabToQueue(const Matrix44& model, GTR::Prefab* prefab, Camera* camera);
+		void addNodeToQueue(const Matrix44& model, GTR::Node* node, Camera* camera);
+		void sortRenderQueue(Camera* camera);
+		void renderQueue(Camera* camera);
+		void renderCall(const RenderCall& rc, Camera* camera, const Matrix44* instanced_models = NULL, int num_instances = 0);
+
+		//shader used by the current pass (shadow, deferred or forward)
+		Shader* getPassShader();
+
+		//fill the uniform buffers
+		void uploadCameraData(Camera* camera);
+		void uploadLightsData();
+		void uploadLightGroup(int group);
+		int bindLight(int index);	//binds the group of the light in frame_lights, returns its index inside the group
+		void uploadMaterialData(Material* material);
+		void bindShadowMaps(Shader* shader, int slot);	//uses slot for the atlas and the next MAX_POINT_SHADOWS for the cubemaps
+		void allocateShadowAtlas(Camera* camera);
+		void createPointShadowMaps();
+		void renderPointShadowMap(Light* light);
+
+		void computeLightTiles(Camera* camera, int width, int height);
+		void setLightingPassUniforms(Shader* shader, int width, int height);
+		Mesh* getLightVolume(Light* light, Matrix44& model);
 
-		//to render one mesh given its material and transformation matrix
-		void renderMeshWithMaterial(const Matrix44 model, Mesh* mesh, GTR::Material* material, Camera* camera);
+		//builds the 64 bits key used to sort the render calls
+		static uint64 computeRenderKey(int pass, Shader* shader, Material* material, Mesh* mesh, float depth);
 	};
 
-};
\ No newline at end of file
+};
@@ -4,6 +4,13 @@
 #include "texture.h"
 
 #include "camera.h"
+#include "gpuprofiler.h"
+#include "cpuprofiler.h"
+#include "material.h"
+
+#include <random>
+#include <algorithm>
+#include <cmath>
 
 Scene* Scene::instance = nullptr;
 
@@ -14,6 +21,7 @@ Scene::Scene()
 	numPrefabEntities = 0;
 	ambientLight = Vector3(0.1f, 0.1f, 0.1f);
 	gizmoEntity = nullptr;
+	animation_speed = 0.5f;
 }
 
 void Scene::render(Camera* camera, GTR::Renderer* renderer) {
@@ -24,29 +32,55 @@ void Scene::render(Camera* camera, GTR::Renderer* renderer) {
 	else
 		Scene::getInstance()->ambientLight = Vector3(0.1, 0.1, 0.1);
 
-	for (size_t i = 0; i < this->prefabEntities.size(); i++) {
-		renderer->shadow = true;
-		this->prefabEntities.at(i)->render(camera, renderer);
-		renderer->shadow = false;
-		this->prefabEntities.at(i)->render(camera, renderer);
-	}
+	renderer->shadow = true;
+	renderer->renderScene(camera);
+	renderer->shadow = false;
+	renderer->renderScene(camera);
 };
 
-void Scene::generateTerrain(float size)
+//procedural prefabs are registered with a name, so generating a scene again reuses them
+static GTR::Prefab* findPrefab(const std::string& name)
 {
-	Mesh* floorMesh = new Mesh();
-	floorMesh->createPlane(size);
-
-	GTR::Prefab* floorPrefab = new GTR::Prefab();
+	auto it = GTR::Prefab::sPrefabsLoaded.find(name);
+	return it != GTR::Prefab::sPrefabsLoaded.end() ? it->second : NULL;
+}
 
-	floorPrefab->name = "floor";
-	floorPrefab->root.mesh = floorMesh;
-	floorPrefab->root.material = GTR::Material::Get("asphalt");
-	floorPrefab->root.material->tilling_factor = 10;
+void Scene::generateTerrain(float size)
+{
+	std::string name = "floor " + std::to_string((int)size);
+	GTR::Prefab* floorPrefab = findPrefab(name);
+	if (!floorPrefab)
+	{
+		Mesh* floorMesh = new Mesh();
+		floorMesh->createPlane(size);
+
+		floorPrefab = new GTR::Prefab();
+		floorPrefab->registerPrefab(name);
+		floorPrefab->root.mesh = floorMesh;
+		floorPrefab->root.material = GTR::Material::Get("asphalt");
+		floorPrefab->root.material->tilling_factor = 10;
+	}
 	PrefabEntity* floorEntity = new PrefabEntity(floorPrefab);
 	this->prefabEntities.push_back(floorEntity);
 }
 
+bool Scene::generate(const char* name, Camera* camera)
+{
+	std::string scene = name;
+	if (scene == "default")
+		generateScene(camera);
+	else if (scene == "test")
+		generateTestScene();
+	else if (scene == "stress")
+		generateStressScene(stress_desc);
+	else
+	{
+		std::cout << "Error: unknown scene " << name << std::endl;
+		return false;
+	}
+	return true;
+}
+
 void Scene::generateScene(Camera* camera) {
 
 	//generate floor
@@ -183,16 +217,46 @@ void Scene::generateTestScene()
 	this->prefabEntities.push_back(cubeEntity);
 }
 
-void Scene::generateDepthMap(GTR::Renderer* renderer)
+void Scene::generateDepthMap(GTR::Renderer* renderer, Camera* camera)
 {
+	CPUZone zone("Scene::generateDepthMap");
+
+	//the tiles depend on how big the lights are seen from the camera
+	renderer->allocateShadowAtlas(camera);
+
+	//the id makes the zones of lights with the same name different
+	char zone_name[GPUPROFILER_NAME];
+	renderer->shadow_atlas->bind();
 	for (auto light : lightEntities)
 	{
-		light->renderShadowMap(renderer);
+		if (light->light_type != lightType::POINT_LIGHT)
+		{
+			snprintf(zone_name, sizeof(zone_name), "shadow %u (%s)", light->id, light->name.c_str());
+			GPUZone gpu_zone(zone_name);
+			CPUZone cpu_zone("shadow map");
+			light->renderShadowMap(renderer, camera);
+		}
+	}
+	renderer->shadow_atlas->unbind();
+
+	//point lights render into their own cubemap
+	for (auto light : lightEntities)
+	{
+		if (light->light_type == lightType::POINT_LIGHT)
+		{
+			snprintf(zone_name, sizeof(zone_name), "shadow %u (%s)", light->id, light->name.c_str());
+			GPUZone gpu_zone(zone_name);
+			CPUZone cpu_zone("point shadow map");
+			light->renderShadowMap(renderer, camera);
+		}
 	}
 }
 
 void Scene::update(Camera* camera)
 {
+	for (auto entity : prefabEntities)
+		entity->updateMovement();
+
 	for (auto light : lightEntities)
 	{
 		if (light->light_type == lightType::DIRECTIONAL)
@@ -202,7 +266,204 @@ void Scene::update(Camera* camera)
 	}
 }
 
+bool Scene::castersMovedInFrustum(Camera* camera)
+{
+	for (auto entity : prefabEntities)
+	{
+		if (!entity->moved)
+			continue;
+		if (camera->testBoxInFrustum(entity->world_bounding.center, entity->world_bounding.halfsize) ||
+			camera->testBoxInFrustum(entity->last_world_bounding.center, entity->last_world_bounding.halfsize))
+			return true;
+	}
+	return false;
+}
+
+bool Scene::castersMovedInSphere(const Vector3& center, float radius)
+{
+	for (auto entity : prefabEntities)
+	{
+		if (!entity->moved)
+			continue;
+		if (BoundingBoxSphereOverlap(entity->world_bounding, center, radius) ||
+			BoundingBoxSphereOverlap(entity->last_world_bounding, center, radius))
+			return true;
+	}
+	return false;
+}
+
 void Scene::renderDeferred(Camera* camera, GTR::Renderer* renderer)
 {
 	renderer->renderDeferred(camera);
-}
\ No newline at end of file
+}
+
+sStressSceneDesc::sStressSceneDesc()
+{
+	num_objects = 1000;
+	num_point_lights = 16;
+	num_spot_lights = 4;
+	random = false;
+	spacing = 60.0f;
+	min_light_range = 100.0f;
+	max_light_range = 400.0f;
+	hierarchy_depth = 1;
+	animated = false;
+	seed = 1;
+}
+
+bool sStressSceneDesc::parseArgument(int argc, char** argv, int& i)
+{
+	std::string arg = argv[i];
+	bool has_value = i + 1 < argc;
+	if (arg == "--random")
+		random = true;
+	else if (arg == "--animated")
+		animated = true;
+	else if (arg == "--objects" && has_value)
+		num_objects = atoi(argv[++i]);
+	else if (arg == "--point-lights" && has_value)
+		num_point_lights = atoi(argv[++i]);
+	else if (arg == "--spot-lights" && has_value)
+		num_spot_lights = atoi(argv[++i]);
+	else if (arg == "--spacing" && has_value)
+		spacing = (float)atof(argv[++i]);
+	else if (arg == "--depth" && has_value)
+		hierarchy_depth = std::max(atoi(argv[++i]), 1);
+	else if (arg == "--seed" && has_value)
+		seed = (unsigned int)atoi(argv[++i]);
+	else if (arg == "--prefab" && has_value)
+		prefab = argv[++i];
+	else
+		return false;
+	return true;
+}
+
+void sStressSceneDesc::renderInMenu()
+{
+#ifndef SKIP_IMGUI
+	ImGui::DragInt("Objects", &num_objects, 10.0f, 0, 100000);
+	ImGui::SliderInt("Point Lights", &num_point_lights, 0, 100);
+	ImGui::SliderInt("Spot Lights", &num_spot_lights, 0, 100);
+	ImGui::Checkbox("Random", &random);
+	ImGui::SliderFloat("Spacing", &spacing, 10.0f, 500.0f);
+	ImGui::DragFloatRange2("Light Range", &min_light_range, &max_light_range, 5.0f, 10.0f, 5000.0f);
+	ImGui::SliderInt("Hierarchy Depth", &hierarchy_depth, 1, 16);
+	ImGui::Checkbox("Animated", &animated);
+	ImGui::InputInt("Seed", (int*)&seed);
+#endif
+}
+
+//a column of boxes, every one child of the previous and smaller
+static GTR::Prefab* createStressPrefab(int depth)
+{
+	std::string name = "stress " + std::to_string(depth);
+	GTR::Prefab* prefab = findPrefab(name);
+	if (prefab)
+		return prefab;
+
+	static Mesh* box = NULL;
+	static GTR::Material* material = NULL;
+	if (!box)
+	{
+		box = new Mesh();
+		box->createCube();
+		material = new GTR::Material();
+		material->roughness_factor = 0.6f;
+	}
+
+	prefab = new GTR::Prefab();
+	prefab->registerPrefab(name);
+	GTR::Node* node = &prefab->root;
+	node->model.setScale(10.0f, 10.0f, 10.0f);
+	for (int i = 0; i < depth; ++i)
+	{
+		if (i > 0)
+		{
+			GTR::Node* child = new GTR::Node();
+			child->model.setTranslation(0.0f, 1.7f, 0.0f);
+			child->model.scale(0.7f, 0.7f, 0.7f);
+			node->addChild(child);
+			node = child;
+		}
+		node->mesh = box;
+		node->material = material;
+	}
+	return prefab;
+}
+
+//N objects in a grid or spread randomly with M lights of random ranges, always the same for the same description
+void Scene::generateStressScene(const sStressSceneDesc& desc)
+{
+	std::mt19937 rng(desc.seed);
+	auto random = [&rng](float min, float max) { return min + (max - min) * (rng() / (float)rng.max()); };
+
+	int side = (int)ceil(sqrt((float)std::max(desc.num_objects, 1)));
+	float half_size = side * desc.spacing * 0.5f;
+	generateTerrain(std::max(half_size * 2.0f, 1000.0f));
+	this->ambientLight = Vector3(0.1, 0.1, 0.1);
+
+	GTR::Prefab* prefab = NULL;
+	if (desc.prefab.size())
+		prefab = GTR::Prefab::Get(desc.prefab.c_str());
+	if (!prefab)
+		prefab = createStressPrefab(desc.hierarchy_depth);
+
+	for (int i = 0; i < desc.num_objects; ++i)
+	{
+		PrefabEntity* entity = new PrefabEntity(prefab);
+		if (desc.random)
+		{
+			entity->setPosition(random(-half_size, half_size), 0.0f, random(-half_size, half_size));
+			entity->model.rotate(random(0.0f, 2.0f * PI), Vector3(0, 1, 0));
+		}
+		else
+			entity->setPosition((i % side) * desc.spacing - half_size, 0.0f, (i / side) * desc.spacing - half_size);
+		prefabEntities.push_back(entity);
+		if (desc.animated)
+			animated_entities.push_back(entity);
+	}
+
+	int num_lights = desc.num_point_lights + desc.num_spot_lights;
+	for (int i = 0; i < num_lights; ++i)
+	{
+		bool spot = i >= desc.num_point_lights;
+		Light* light = new Light(spot ? lightType::SPOT : lightType::POINT_LIGHT);
+		light->setPosition(random(-half_size, half_size), random(20.0f, 200.0f), random(-half_size, half_size));
+		light->setColor(random(0.2f, 1.0f), random(0.2f, 1.0f), random(0.2f, 1.0f));
+		light->maxDist = random(desc.min_light_range, desc.max_light_range);
+		light->intensity = 2.0f;
+		if (spot)
+		{
+			//looking down with some angle, straight down would need other up vector
+			light->model.rotate(random(0.0f, 2.0f * PI), Vector3(0, 1, 0));
+			light->model.rotate(random(50.0f, 80.0f) * DEG2RAD, Vector3(-1, 0, 0));
+			light->camera->far_plane = light->maxDist;
+			light->camera->lookAt(light->model.getTranslation(),
+				light->model.getTranslation() + light->model.frontVector(), Vector3(0, 1, 0));
+		}
+		lightEntities.push_back(light);
+	}
+
+	std::cout << "Stress scene: " << desc.num_objects << " objects, " << num_lights << " lights" << std::endl;
+	if (num_lights > MAX_LIGHTS)
+		std::cout << " * lights beyond " << MAX_LIGHTS << " are added with one pass each" << std::endl;
+}
+
+//prefabs are not deleted, the loaded and the procedural ones are cached by name and reused
+void Scene::clear()
+{
+	for (auto entity : prefabEntities)
+		delete entity;
+	for (auto light : lightEntities)
+		delete light;
+	prefabEntities.clear();
+	lightEntities.clear();
+	animated_entities.clear();
+	gizmoEntity = nullptr;
+}
+
+void Scene::animate(float seconds_elapsed)
+{
+	for (auto entity : animated_entities)
+		entity->model.rotate(seconds_elapsed * animation_speed, Vector3(0, 1, 0));
+}
@@ -7,6 +7,26 @@
 #include "entity.h"
 #include "renderer.h"
 
+//parameters of Scene::generateStressScene, to measure how the renderer scales with the number of objects and lights
+struct sStressSceneDesc
+{
+	int num_objects;
+	int num_point_lights;
+	int num_spot_lights;
+	bool random;	//random positions and rotations, otherwise a grid
+	float spacing;	//distance between objects in the grid (and average distance when random)
+	float min_light_range;
+	float max_light_range;
+	int hierarchy_depth;	//nodes of every object, each one child of the previous (only for the box)
+	bool animated;	//the objects rotate every frame, so they are always moving casters
+	unsigned int seed;	//same seed, same scene
+	std::string prefab;	//gltf to instance, a box if empty
+
+	sStressSceneDesc();
+	bool parseArgument(int argc, char** argv, int& i);	//--objects n --point-lights n --spot-lights n --random --spacing d --depth n --animated --seed n --prefab file
+	void renderInMenu();
+};
+
 class Scene {
 private:
 	static Scene* instance;
@@ -22,6 +42,10 @@ public:
 	unsigned int numLightEntities;
 	bool ambient_light;
 
+	sStressSceneDesc stress_desc;
+	std::vector<PrefabEntity*> animated_entities;
+	float animation_speed;	//radians per second
+
 	FBO* fbo;
 
 	static Scene* getInstance()
@@ -33,11 +57,17 @@ public:
 
 	void render(Camera* camera, GTR::Renderer* renderer);
 	void renderDeferred(Camera* camera, GTR::Renderer* renderer);
+	bool generate(const char* name, Camera* camera);	//one of the scenes below by name, false if there is none
 	void generateScene(Camera* camera);
 	void generateTerrain(float size);
 	void generateTestScene();
-	void generateDepthMap(GTR::Renderer* renderer);
+	void generateStressScene(const sStressSceneDesc& desc);
+	void clear();	//deletes all the entities
+	void animate(float seconds_elapsed);
+	void generateDepthMap(GTR::Renderer* renderer, Camera* camera);
 	void update(Camera* camera);
+	bool castersMovedInFrustum(Camera* camera); //if any entity that moved in this update was or is inside the frustum
+	bool castersMovedInSphere(const Vector3& center, float radius); //same for the range of a point light
 };
 
 #endif // !SCENE_H
\ No newline at end of file
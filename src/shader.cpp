@@ -8,6 +8,10 @@
 #include <locale>
 
 #include "texture.h"
+#include "ubo.h"
+#include "glstate.h"
+#include "cpuprofiler.h"
+#include "mesh.h"
 
 std::string Shader::s_shader_atlas_filename;
 std::map<std::string, std::string> Shader::s_shaders_atlas;
@@ -62,7 +66,9 @@ Shader::Shader()
 	if(!Shader::s_ready)
 		Shader::init();
 	compiled = false;
+	has_instanced_model = false;
 	from_atlas = false;
+	vs = fs = gs = program = 0;
 }
 
 Shader::~Shader()
@@ -161,6 +167,7 @@ void Shader::setMacros(const char* macros)
 
 bool Shader::LoadAtlas(const char* filename)
 {
+	CPUZone zone("Shader::LoadAtlas");
 	std::string content;
 	if (!readFile(filename, content))
 	{
@@ -230,9 +237,19 @@ bool Shader::LoadAtlas(const char* filename)
 		std::string macros = "";
 		if(pos3 != std::string::npos)
 			macros = line.substr(pos3+1);
+
+		//optional geometry shader
+		std::string gs_filename = "";
+		if (macros.size() > 3 && macros.find_first_of(' ') == std::string::npos && macros.substr(macros.size() - 3) == ".gs")
+		{
+			gs_filename = macros;
+			macros = "";
+		}
+
 		std::string vs_code = s_shaders_atlas[vs_filename];
 		std::string fs_code = s_shaders_atlas[fs_filename];
-		if(!vs_code.size() || !fs_code.size())
+		std::string gs_code = gs_filename.size() ? s_shaders_atlas[gs_filename] : "";
+		if(!vs_code.size() || !fs_code.size() || (gs_filename.size() && !gs_code.size()))
 		{
 			std::cout << " * Error in shader atlas, couldnt find files for " << name << std::endl;
 			continue;
@@ -246,17 +263,36 @@ bool Shader::LoadAtlas(const char* filename)
 		if(it == s_Shaders.end())
 		{
 			shader = new Shader();
-			s_Shaders[ name ] = shader;
+			if (!shader->compileFromMemory(vs_code, fs_code, gs_code))
+			{
+				delete shader;
+				std::cout << " * Compilation error in shader at atlas: " << name << std::endl;
+				return false; //stop here
+			}
+			s_Shaders[name] = shader;
 		}
 		else
-			shader = it->second;
-	
-		if (!shader->compileFromMemory(vs_code,fs_code))
 		{
-			delete shader;
-			std::cout << " * Compilation error in shader at atlas: " << name << std::endl;
-            return false; //stop here
-			continue;
+			//reloading: the Shader object is kept so pointers to it remain valid,
+			//and if the new code doesnt compile the previous program is still used
+			shader = it->second;
+			Shader* reloaded = new Shader();
+			if (!reloaded->compileFromMemory(vs_code, fs_code, gs_code))
+			{
+				delete reloaded;
+				std::cout << " * Compilation error in shader at atlas: " << name << std::endl;
+				continue;
+			}
+			shader->release();
+			shader->vs = reloaded->vs;
+			shader->fs = reloaded->fs;
+			shader->gs = reloaded->gs;
+			shader->program = reloaded->program;
+			shader->compiled = true;
+			shader->has_instanced_model = reloaded->has_instanced_model;
+			reloaded->vs = reloaded->fs = reloaded->gs = reloaded->program = 0;
+			delete reloaded;
+			shader->updateUniformLocations();
 		}
 
 		shader->vs_filename = vs_filename;
@@ -294,7 +330,7 @@ bool Shader::hasInfoLog() const
 
 // ******************************************
 
-bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
+bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm, const std::string& gsm)
 {
 	if (glCreateProgram == 0)
 	{
@@ -317,6 +353,22 @@ bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
 		return false;
 	}
 
+	if (gsm.size() && !createGeometryShaderObject(gsm))
+	{
+		printf("Geometry shader compilation failed\n");
+		return false;
+	}
+
+	//fixed locations so every shader matches the layout of the mesh VAOs
+	glBindAttribLocation(program, VERTEX_ATTRIB, "a_vertex");
+	glBindAttribLocation(program, NORMAL_ATTRIB, "a_normal");
+	glBindAttribLocation(program, UV_ATTRIB, "a_uv");
+	glBindAttribLocation(program, COLOR_ATTRIB, "a_color");
+	glBindAttribLocation(program, UV1_ATTRIB, "a_uv1");
+	glBindAttribLocation(program, BONES_ATTRIB, "a_bones");
+	glBindAttribLocation(program, WEIGHTS_ATTRIB, "a_weights");
+	glBindAttribLocation(program, INSTANCED_MODEL_ATTRIB, "u_model");
+
 	glLinkProgram(program);
 	assert (glGetError() == GL_NO_ERROR);
 
@@ -332,6 +384,14 @@ bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
 		return false;
 	}
 
+	//link the uniform blocks declared in the atlas to their fixed binding points
+	bindUniformBlock("CameraBlock", UBO_CAMERA);
+	bindUniformBlock("LightBlock", UBO_LIGHTS);
+	bindUniformBlock("MaterialBlock", UBO_MATERIAL);
+
+	updateUniformLocations();
+	has_instanced_model = glGetAttribLocation(program, "u_model") == INSTANCED_MODEL_ATTRIB;
+
 #ifdef _DEBUG
 	validate();
 #endif
@@ -341,6 +401,15 @@ bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
 	return true;
 }
 
+void Shader::bindUniformBlock(const char* blockname, int binding)
+{
+	GLuint index = glGetUniformBlockIndex(program, blockname);
+	if (index == GL_INVALID_INDEX)
+		return; //this shader doesnt use that block
+	glUniformBlockBinding(program, index, binding);
+	assert(glGetError() == GL_NO_ERROR);
+}
+
 bool Shader::validate()
 {
 	glValidateProgram(program);
@@ -370,6 +439,11 @@ bool Shader::createFragmentShaderObject(const std::string& shader)
 	return createShaderObject(GL_FRAGMENT_SHADER,fs,shader);
 }
 
+bool Shader::createGeometryShaderObject(const std::string& shader)
+{
+	return createShaderObject(GL_GEOMETRY_SHADER,gs,shader);
+}
+
 bool Shader::createShaderObject(unsigned int type, GLuint& handle, const std::string& code)
 {
 	handle = glCreateShader(type);
@@ -424,16 +498,28 @@ void Shader::release()
 		fs = 0;
 	}
 
+	if (gs)
+	{
+		glDeleteShader(gs);
+		assert (glGetError() == GL_NO_ERROR);
+		gs = 0;
+	}
+
 	if (program)
 	{
 		glDeleteProgram(program);
+		GLState::invalidate(); //the id could be reused by a new program
 		assert (glGetError() == GL_NO_ERROR);
 		program = 0;
+		if (current == this)
+			current = NULL;
 	}
 
 	locations.clear();
+	uniform_locations.clear();
 
 	compiled = false;
+	has_instanced_model = false;
 }
 
 
@@ -444,7 +530,7 @@ void Shader::enable()
 
 	current = this;
 
-	glUseProgram(program);
+	GLState::useProgram(program);
     GLuint err = glGetError();
 	assert (err == GL_NO_ERROR);
 
@@ -456,14 +542,14 @@ void Shader::disable()
 {
 	current = NULL;
 
-	glUseProgram(0);
+	GLState::useProgram(0);
 	//glActiveTexture(GL_TEXTURE0);
 	assert (glGetError() == GL_NO_ERROR);
 }
 
 void Shader::disableShaders()
 {
-	glUseProgram(0);
+	GLState::useProgram(0);
 	assert (glGetError() == GL_NO_ERROR);
 }
 
@@ -538,6 +624,30 @@ GLint Shader::getLocation(const char* varname,loctable* table)
 	return loc;
 }
 
+std::vector<std::string>& UniformID::getNames()
+{
+	static std::vector<std::string> names; //local so it exists before any static UniformID
+	return names;
+}
+
+UniformID::UniformID(const char* varname)
+{
+	std::vector<std::string>& names = getNames();
+	for (index = 0; index < (int)names.size(); ++index)
+		if (names[index] == varname)
+			return;
+	names.push_back(varname);
+}
+
+void Shader::updateUniformLocations()
+{
+	std::vector<std::string>& names = UniformID::getNames();
+	int first = (int)uniform_locations.size();
+	uniform_locations.resize(names.size());
+	for (int i = first; i < (int)names.size(); ++i)
+		uniform_locations[i] = program ? glGetUniformLocation(program, names[i].c_str()) : -1;
+}
+
 int Shader::getAttribLocation(const char* varname)
 {
 	int loc = glGetAttribLocation(program, varname);
@@ -563,10 +673,71 @@ int Shader::getUniformLocation(const char* varname)
 
 void Shader::setTexture(const char* varname, Texture* tex, int slot)
 {
-	glActiveTexture(GL_TEXTURE0 + slot);
-	glBindTexture(tex->texture_type, tex->texture_id);
+	GLState::bindTexture(slot, tex->texture_type, tex->texture_id);
 	setUniform1(varname, slot);
-	glActiveTexture(GL_TEXTURE0 + slot);
+}
+
+void Shader::setUniform(const UniformID& id, int input)
+{
+	assert(current == this);
+	GLint loc = getLocation(id);
+	CHECK_SHADER_VAR(loc, id);
+	glUniform1i(loc, input);
+}
+
+void Shader::setUniform(const UniformID& id, float input)
+{
+	assert(current == this);
+	GLint loc = getLocation(id);
+	CHECK_SHADER_VAR(loc, id);
+	glUniform1f(loc, input);
+}
+
+void Shader::setUniform(const UniformID& id, const Vector2& input)
+{
+	assert(current == this);
+	GLint loc = getLocation(id);
+	CHECK_SHADER_VAR(loc, id);
+	glUniform2f(loc, input.x, input.y);
+}
+
+void Shader::setUniform(const UniformID& id, const Vector3& input)
+{
+	assert(current == this);
+	GLint loc = getLocation(id);
+	CHECK_SHADER_VAR(loc, id);
+	glUniform3f(loc, input.x, input.y, input.z);
+}
+
+void Shader::setUniform(const UniformID& id, const Vector4& input)
+{
+	assert(current == this);
+	GLint loc = getLocation(id);
+	CHECK_SHADER_VAR(loc, id);
+	glUniform4f(loc, input.x, input.y, input.z, input.w);
+}
+
+void Shader::setUniform(const UniformID& id, const Matrix44& input)
+{
+	assert(current == this);
+	GLint loc = getLocation(id);
+	CHECK_SHADER_VAR(loc, id);
+	glUniformMatrix4fv(loc, 1, GL_FALSE, input.m);
+}
+
+void Shader::setMatrix44Array(const UniformID& id, const Matrix44* m_array, int num)
+{
+	assert(current == this);
+	GLint loc = getLocation(id);
+	CHECK_SHADER_VAR(loc, id);
+	glUniformMatrix4fv(loc, num, GL_FALSE, (const GLfloat*)m_array);
+}
+
+void Shader::setUniform(const UniformID& id, Texture* tex, int slot)
+{
+	assert(current == this);
+	GLState::bindTexture(slot, tex->texture_type, tex->texture_id);
+	setUniform(id, slot);
 }
 
 /*
@@ -20,6 +20,17 @@
 
 class Texture;
 
+//handle of a uniform, shared by all the shaders and resolved by name only once (usually as a static)
+//every shader keeps the location of each handle, so setting it does not need any lookup
+class UniformID
+{
+public:
+	int index;
+	explicit UniformID(const char* varname);
+
+	static std::vector<std::string>& getNames(); //name of every handle, by index
+};
+
 class Shader
 {
 	int last_slot;
@@ -39,7 +50,7 @@ public:
 	virtual bool load(const std::string& vsf, const std::string& psf, const char* macros);
 
 	//internal functions
-	virtual bool compileFromMemory(const std::string& vsm, const std::string& psm);
+	virtual bool compileFromMemory(const std::string& vsm, const std::string& psm, const std::string& gsm = ""); //geometry shader is optional
 	virtual void release();
 	virtual void enable();
 	virtual void disable();
@@ -64,6 +75,17 @@ public:
 	//for textures you must specify an slot (a number from 0 to 16) where this texture is stored in the shader
 	void setUniform(const char* varname, Texture* texture, int slot) { assert(current == this); setTexture(varname, texture, slot); }
 
+	//upload using handles (faster, no strings involved)
+	void setUniform(const UniformID& id, bool input) { setUniform(id, (int)input); }
+	void setUniform(const UniformID& id, int input);
+	void setUniform(const UniformID& id, float input);
+	void setUniform(const UniformID& id, const Vector2& input);
+	void setUniform(const UniformID& id, const Vector3& input);
+	void setUniform(const UniformID& id, const Vector4& input);
+	void setUniform(const UniformID& id, const Matrix44& input);
+	void setUniform(const UniformID& id, Texture* texture, int slot);
+	void setMatrix44Array(const UniformID& id, const Matrix44* m_array, int num);
+
 
 	virtual void setInt(const char* varname, const int& input) { setUniform1(varname, input); }
 	virtual void setFloat(const char* varname, const float& input) { setUniform1(varname, input); }
@@ -101,10 +123,16 @@ public:
 
 	virtual int getAttribLocation(const char* varname);
 	virtual int getUniformLocation(const char* varname);
+	GLint getLocation(const UniformID& id) { if (id.index >= (int)uniform_locations.size()) updateUniformLocations(); return uniform_locations[id.index]; }
+	void updateUniformLocations(); //resolves the location of every UniformID in this program
+
+	//links a uniform block of the shader to a binding point (see UBO)
+	void bindUniformBlock(const char* blockname, int binding);
 
 	std::string getInfoLog() const;
 	bool hasInfoLog() const;
 	bool compiled;
+	bool has_instanced_model; //u_model is an attribute at INSTANCED_MODEL_ATTRIB, checked once when linking
 
 	void setMacros(const char * macros);
 
@@ -114,6 +142,7 @@ public:
 
 	//this is a way to load a single file that contains all the shaders 
 	//to know more about the file format, it is based in this https://github.com/jagenjo/rendeer.js/tree/master/guides#the-shaders but with tiny differences
+	//a third file ending in .gs after the vs and fs is used as geometry shader
 	static bool LoadAtlas(const char* filename);
 	static std::string s_shader_atlas_filename;
 	static std::map<std::string, std::string> s_shaders_atlas; //stores strings, no shaders
@@ -130,6 +159,7 @@ protected:
 
 	bool createVertexShaderObject(const std::string& shader);
 	bool createFragmentShaderObject(const std::string& shader);
+	bool createGeometryShaderObject(const std::string& shader);
 	bool createShaderObject(unsigned int type, GLuint& handle, const std::string& shader);
 	void saveShaderInfoLog(GLuint obj);
 	void saveProgramInfoLog(GLuint obj);
@@ -138,9 +168,12 @@ protected:
 
 	GLuint vs;
 	GLuint fs;
+	GLuint gs;
 	GLuint program;
 	std::string log;
 
+	std::vector<GLint> uniform_locations; //indexed by UniformID
+
 //this is a hack to speed up shader usage (save info locally)
 private: 
 
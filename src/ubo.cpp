@@ -0,0 +1,46 @@
+#include "ubo.h"
+#include <cassert>
+#include "utils.h"
+
+UBO::UBO()
+{
+	ubo_id = 0;
+	size = 0;
+	binding = -1;
+}
+
+UBO::~UBO()
+{
+	if (ubo_id)
+		glDeleteBuffers(1, &ubo_id);
+}
+
+void UBO::create(int size, int binding)
+{
+	assert(size > 0 && binding >= 0);
+	this->size = size;
+	this->binding = binding;
+
+	if (ubo_id == 0)
+		glGenBuffers(1, &ubo_id);
+	glBindBuffer(GL_UNIFORM_BUFFER, ubo_id);
+	glBufferData(GL_UNIFORM_BUFFER, size, NULL, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+	//the binding point stays attached to the buffer, no need to bind it again before every draw
+	glBindBufferBase(GL_UNIFORM_BUFFER, binding, ubo_id);
+	checkGLErrors();
+}
+
+void UBO::upload(const void* data, int size, int offset)
+{
+	assert(ubo_id && "UBO must be created before uploading data");
+	assert(offset + size <= this->size && "data doesnt fit in the UBO");
+
+	glBindBuffer(GL_UNIFORM_BUFFER, ubo_id);
+	if (offset == 0 && size == this->size)
+		glBufferData(GL_UNIFORM_BUFFER, size, data, GL_DYNAMIC_DRAW); //orphan the old storage to avoid waiting for the GPU
+	else
+		glBufferSubData(GL_UNIFORM_BUFFER, offset, size, data);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
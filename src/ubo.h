@@ -0,0 +1,30 @@
+#ifndef UBO_H
+#define UBO_H
+
+#include "includes.h"
+
+//binding points shared by every shader, the blocks are declared in the shader atlas
+enum eUBOBinding {
+	UBO_CAMERA = 0,
+	UBO_LIGHTS = 1,
+	UBO_MATERIAL = 2
+};
+
+//UniformBufferObject
+//stores a block of uniforms in VRAM so it can be uploaded once and shared by all the shaders
+//the C++ struct uploaded must follow the std140 layout of the block in the shader
+
+class UBO {
+public:
+	GLuint ubo_id;
+	int size;
+	int binding;
+
+	UBO();
+	~UBO();
+
+	void create(int size, int binding);
+	void upload(const void* data, int size, int offset = 0);
+};
+
+#endif